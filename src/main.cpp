@@ -14,8 +14,10 @@
 
 #include <ai.h>
 #include <cstring>
+#include "noise.h"
 
 extern AtNodeMethods *SeExprMtd;
+extern AtNodeMethods *SeExprOutputMtd;
 
 namespace SSTR
 {
@@ -33,16 +35,55 @@ namespace SSTR
    AtString relative_motion_frame("relative_motion_frame");
    AtString shutter_start("shutter_start");
    AtString shutter_end("shutter_end");
+   AtString backend("backend");
+   AtString seexpr_backend("seexpr_backend");
+   AtString seexpr_lazy_compile("seexpr_lazy_compile");
+   AtString seexpr_compile_threads("seexpr_compile_threads");
+   AtString seexpr_stats("seexpr_stats");
+   AtString seexpr_stats_file("seexpr_stats_file");
+   AtString output_names("output_names");
+   AtString curve_resolution("curve_resolution");
+   AtString input("input");
+   AtString output("output");
 }
 
+// seexpr variants share the same methods, the expression return type is
+//   deduced from the node entry output type
+static const char* NodeNames[] =
+{
+   "seexpr",
+   "seexpr_float",
+   "seexpr_rgb",
+   "seexpr_rgba",
+   "seexpr_output",
+   NULL
+};
+
+static const int NodeOutputTypes[] =
+{
+   AI_TYPE_VECTOR,
+   AI_TYPE_FLOAT,
+   AI_TYPE_RGB,
+   AI_TYPE_RGBA,
+   AI_TYPE_VECTOR
+};
+
 node_loader
 {
-   if (i == 0)
+   if (i >= 0 && NodeNames[i] != NULL)
    {
-      node->name = "seexpr";
+      if (i == 0)
+      {
+         if (NoiseKernelsWarning())
+         {
+            AiMsgWarning("[seexpr] %s", NoiseKernelsWarning());
+         }
+         AiMsgDebug("[seexpr] Using %s noise kernels", NoiseKernelsName());
+      }
+      node->name = NodeNames[i];
       node->node_type = AI_NODE_SHADER;
-      node->output_type = AI_TYPE_VECTOR;
-      node->methods = SeExprMtd;
+      node->output_type = NodeOutputTypes[i];
+      node->methods = (strcmp(NodeNames[i], "seexpr_output") ? SeExprMtd : SeExprOutputMtd);
       strcpy(node->version, AI_VERSION);
       return true;
    }
@@ -0,0 +1,649 @@
+// Copyright 2014 Gaetan Guidet
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "noise.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#  define SEEXPR_NOISE_X86
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#     include <intrin.h>
+#  endif
+#endif
+
+// Kernels are compiled for their instruction set whatever the build flags,
+//   they only run when the CPU supports it
+#if defined(__GNUC__) || defined(__clang__)
+#  define SEEXPR_TARGET(isa) __attribute__((target(isa)))
+#else
+#  define SEEXPR_TARGET(isa)
+#endif
+
+// Same limit as SeExpr's fbm, turbulence and vfbm
+#define SEEXPR_NOISE_MAX_OCTAVES 8
+
+// Widest kernel lane count, noise inputs and outputs are padded to it
+#define SEEXPR_NOISE_PAD 8
+
+// Permutation and gradient tables from the SeExpr sources (src/SeExpr2),
+//   kept in their own namespace as SeExpr's Noise.cpp does
+namespace SeExprNoiseTables
+{
+#  include "NoiseTables.h"
+}
+
+static int Perm[256];
+static const double *Gradients = &(SeExprNoiseTables::NOISE_TABLES<3>::g[0][0]);
+
+static bool InitPerm()
+{
+   for (int i=0; i<256; ++i)
+   {
+      Perm[i] = int(SeExprNoiseTables::p[i]);
+   }
+   return true;
+}
+
+static bool gPermInitialized = InitPerm();
+
+// --- Scalar reference (1 lane)
+
+namespace Scalar
+{
+#  define NOISE_TARGET
+
+   static const int W = 1;
+   typedef double vd;
+   typedef int vi;
+
+   // integer arithmetic is done unsigned, as in SeExpr's hashes
+
+   static inline vd Set1(double a) { return a; }
+   static inline vd Load(const double *p) { return *p; }
+   static inline void Store(double *p, vd a) { *p = a; }
+   static inline vd Add(vd a, vd b) { return a + b; }
+   static inline vd Sub(vd a, vd b) { return a - b; }
+   static inline vd Mul(vd a, vd b) { return a * b; }
+   static inline vd Floor(vd a) { return std::floor(a); }
+   static inline vd Gather(const double *base, vi idx) { return base[idx]; }
+   static inline vi Set1i(int a) { return a; }
+   static inline vi Loadi(const int *p) { return *p; }
+   static inline vi Addi(vi a, vi b) { return vi(uint32_t(a) + uint32_t(b)); }
+   static inline vi Mulli(vi a, vi b) { return vi(uint32_t(a) * uint32_t(b)); }
+   static inline vi Xori(vi a, vi b) { return a ^ b; }
+   static inline vi Andi(vi a, vi b) { return a & b; }
+   static inline vi Ori(vi a, vi b) { return a | b; }
+   template <int N> static inline vi Srli(vi a) { return vi(uint32_t(a) >> N); }
+   template <int N> static inline vi Slli(vi a) { return vi(uint32_t(a) << N); }
+   static inline vi Gatheri(const int *base, vi idx) { return base[idx]; }
+   static inline vi CvtI(vd a) { return int(a); }
+   static inline vd CvtU(vi a) { return double(uint32_t(a)); }
+
+#  include "noise_simd.inl"
+#  undef NOISE_TARGET
+}
+
+#ifdef SEEXPR_NOISE_X86
+
+// --- SSE4.1 (2 lanes)
+
+namespace Sse4
+{
+#  define NOISE_TARGET SEEXPR_TARGET("sse4.1")
+
+   // integers are kept in the low lanes of a 128 bits register
+
+   static const int W = 2;
+   typedef __m128d vd;
+   typedef __m128i vi;
+
+   NOISE_TARGET static inline vd Set1(double a) { return _mm_set1_pd(a); }
+   NOISE_TARGET static inline vd Load(const double *p) { return _mm_loadu_pd(p); }
+   NOISE_TARGET static inline void Store(double *p, vd a) { _mm_storeu_pd(p, a); }
+   NOISE_TARGET static inline vd Add(vd a, vd b) { return _mm_add_pd(a, b); }
+   NOISE_TARGET static inline vd Sub(vd a, vd b) { return _mm_sub_pd(a, b); }
+   NOISE_TARGET static inline vd Mul(vd a, vd b) { return _mm_mul_pd(a, b); }
+   NOISE_TARGET static inline vd Floor(vd a) { return _mm_floor_pd(a); }
+   NOISE_TARGET static inline vd Gather(const double *base, vi idx) { return _mm_set_pd(base[_mm_extract_epi32(idx, 1)], base[_mm_cvtsi128_si32(idx)]); }
+   NOISE_TARGET static inline vi Set1i(int a) { return _mm_set1_epi32(a); }
+   NOISE_TARGET static inline vi Loadi(const int *p) { return _mm_loadl_epi64((const __m128i*)p); }
+   NOISE_TARGET static inline vi Addi(vi a, vi b) { return _mm_add_epi32(a, b); }
+   NOISE_TARGET static inline vi Mulli(vi a, vi b) { return _mm_mullo_epi32(a, b); }
+   NOISE_TARGET static inline vi Xori(vi a, vi b) { return _mm_xor_si128(a, b); }
+   NOISE_TARGET static inline vi Andi(vi a, vi b) { return _mm_and_si128(a, b); }
+   NOISE_TARGET static inline vi Ori(vi a, vi b) { return _mm_or_si128(a, b); }
+   template <int N> NOISE_TARGET static inline vi Srli(vi a) { return _mm_srli_epi32(a, N); }
+   template <int N> NOISE_TARGET static inline vi Slli(vi a) { return _mm_slli_epi32(a, N); }
+   NOISE_TARGET static inline vi Gatheri(const int *base, vi idx) { return _mm_set_epi32(0, 0, base[_mm_extract_epi32(idx, 1)], base[_mm_cvtsi128_si32(idx)]); }
+   NOISE_TARGET static inline vi CvtI(vd a) { return _mm_cvttpd_epi32(a); }
+   // unsigned through signed: flip the sign bit and add it back
+   NOISE_TARGET static inline vd CvtU(vi a) { return _mm_add_pd(_mm_cvtepi32_pd(_mm_xor_si128(a, _mm_set1_epi32(int(0x80000000u)))), _mm_set1_pd(2147483648.0)); }
+
+#  include "noise_simd.inl"
+#  undef NOISE_TARGET
+}
+
+// --- AVX2 (4 lanes)
+
+namespace Avx2
+{
+#  define NOISE_TARGET SEEXPR_TARGET("avx2")
+
+   static const int W = 4;
+   typedef __m256d vd;
+   typedef __m128i vi;
+
+   // masked gathers where GCC reports the unmasked ones' undefined
+   //   pass-through values as uninitialized
+
+   NOISE_TARGET static inline vd Set1(double a) { return _mm256_set1_pd(a); }
+   NOISE_TARGET static inline vd Load(const double *p) { return _mm256_loadu_pd(p); }
+   NOISE_TARGET static inline void Store(double *p, vd a) { _mm256_storeu_pd(p, a); }
+   NOISE_TARGET static inline vd Add(vd a, vd b) { return _mm256_add_pd(a, b); }
+   NOISE_TARGET static inline vd Sub(vd a, vd b) { return _mm256_sub_pd(a, b); }
+   NOISE_TARGET static inline vd Mul(vd a, vd b) { return _mm256_mul_pd(a, b); }
+   NOISE_TARGET static inline vd Floor(vd a) { return _mm256_floor_pd(a); }
+   NOISE_TARGET static inline vd Gather(const double *base, vi idx) { return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, idx, _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8); }
+   NOISE_TARGET static inline vi Set1i(int a) { return _mm_set1_epi32(a); }
+   NOISE_TARGET static inline vi Loadi(const int *p) { return _mm_loadu_si128((const __m128i*)p); }
+   NOISE_TARGET static inline vi Addi(vi a, vi b) { return _mm_add_epi32(a, b); }
+   NOISE_TARGET static inline vi Mulli(vi a, vi b) { return _mm_mullo_epi32(a, b); }
+   NOISE_TARGET static inline vi Xori(vi a, vi b) { return _mm_xor_si128(a, b); }
+   NOISE_TARGET static inline vi Andi(vi a, vi b) { return _mm_and_si128(a, b); }
+   NOISE_TARGET static inline vi Ori(vi a, vi b) { return _mm_or_si128(a, b); }
+   template <int N> NOISE_TARGET static inline vi Srli(vi a) { return _mm_srli_epi32(a, N); }
+   template <int N> NOISE_TARGET static inline vi Slli(vi a) { return _mm_slli_epi32(a, N); }
+   NOISE_TARGET static inline vi Gatheri(const int *base, vi idx) { return _mm_mask_i32gather_epi32(_mm_setzero_si128(), base, idx, _mm_set1_epi32(-1), 4); }
+   NOISE_TARGET static inline vi CvtI(vd a) { return _mm256_cvttpd_epi32(a); }
+   NOISE_TARGET static inline vd CvtU(vi a) { return _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(a, _mm_set1_epi32(int(0x80000000u)))), _mm256_set1_pd(2147483648.0)); }
+
+#  include "noise_simd.inl"
+#  undef NOISE_TARGET
+}
+
+// --- AVX-512 (8 lanes)
+
+namespace Avx512
+{
+#  define NOISE_TARGET SEEXPR_TARGET("avx512f")
+
+   static const int W = 8;
+   typedef __m512d vd;
+   typedef __m256i vi;
+
+   // zero masked forms where GCC reports the unmasked ones' undefined
+   //   pass-through values as uninitialized (see Avx2)
+
+   NOISE_TARGET static inline vd Set1(double a) { return _mm512_set1_pd(a); }
+   NOISE_TARGET static inline vd Load(const double *p) { return _mm512_loadu_pd(p); }
+   NOISE_TARGET static inline void Store(double *p, vd a) { _mm512_storeu_pd(p, a); }
+   NOISE_TARGET static inline vd Add(vd a, vd b) { return _mm512_add_pd(a, b); }
+   NOISE_TARGET static inline vd Sub(vd a, vd b) { return _mm512_sub_pd(a, b); }
+   NOISE_TARGET static inline vd Mul(vd a, vd b) { return _mm512_mul_pd(a, b); }
+   NOISE_TARGET static inline vd Floor(vd a) { return _mm512_maskz_roundscale_pd(0xff, a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+   NOISE_TARGET static inline vd Gather(const double *base, vi idx) { return _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xff, idx, base, 8); }
+   NOISE_TARGET static inline vi Set1i(int a) { return _mm256_set1_epi32(a); }
+   NOISE_TARGET static inline vi Loadi(const int *p) { return _mm256_loadu_si256((const __m256i*)p); }
+   NOISE_TARGET static inline vi Addi(vi a, vi b) { return _mm256_add_epi32(a, b); }
+   NOISE_TARGET static inline vi Mulli(vi a, vi b) { return _mm256_mullo_epi32(a, b); }
+   NOISE_TARGET static inline vi Xori(vi a, vi b) { return _mm256_xor_si256(a, b); }
+   NOISE_TARGET static inline vi Andi(vi a, vi b) { return _mm256_and_si256(a, b); }
+   NOISE_TARGET static inline vi Ori(vi a, vi b) { return _mm256_or_si256(a, b); }
+   template <int N> NOISE_TARGET static inline vi Srli(vi a) { return _mm256_srli_epi32(a, N); }
+   template <int N> NOISE_TARGET static inline vi Slli(vi a) { return _mm256_slli_epi32(a, N); }
+   NOISE_TARGET static inline vi Gatheri(const int *base, vi idx) { return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), base, idx, _mm256_set1_epi32(-1), 4); }
+   NOISE_TARGET static inline vi CvtI(vd a) { return _mm512_maskz_cvttpd_epi32(0xff, a); }
+   NOISE_TARGET static inline vd CvtU(vi a) { return _mm512_add_pd(_mm512_maskz_cvtepi32_pd(0xff, _mm256_xor_si256(a, _mm256_set1_epi32(int(0x80000000u)))), _mm512_set1_pd(2147483648.0)); }
+
+#  include "noise_simd.inl"
+#  undef NOISE_TARGET
+}
+
+#endif
+
+// --- Runtime dispatch
+
+struct NoiseKernels
+{
+   const char *name;
+   void (*noise)(const double *x, const double *y, const double *z, int count, double *out);
+   void (*cellnoise)(const int *x, const int *y, const int *z, int count, double *out);
+};
+
+enum NoiseIsa
+{
+   i_scalar = 0,
+   i_sse4,
+   i_avx2,
+   i_avx512
+};
+
+static const NoiseKernels AllKernels[] =
+{
+   {"scalar", Scalar::Noise, Scalar::CellNoise},
+#ifdef SEEXPR_NOISE_X86
+   {"sse4", Sse4::Noise, Sse4::CellNoise},
+   {"avx2", Avx2::Noise, Avx2::CellNoise},
+   {"avx512", Avx512::Noise, Avx512::CellNoise},
+#endif
+   {NULL, NULL, NULL}
+};
+
+static int SupportedIsa()
+{
+#if defined(SEEXPR_NOISE_X86) && (defined(__GNUC__) || defined(__clang__))
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512f"))
+   {
+      return i_avx512;
+   }
+   if (__builtin_cpu_supports("avx2"))
+   {
+      return i_avx2;
+   }
+   if (__builtin_cpu_supports("sse4.1"))
+   {
+      return i_sse4;
+   }
+#elif defined(SEEXPR_NOISE_X86) && defined(_MSC_VER)
+   int info[4];
+   __cpuid(info, 0);
+   int maxLeaf = info[0];
+   __cpuid(info, 1);
+   bool sse4 = ((info[2] & (1 << 19)) != 0);
+   bool osxsave = ((info[2] & (1 << 27)) != 0);
+   bool avx = ((info[2] & (1 << 28)) != 0);
+   // the OS must save the extended registers state
+   unsigned long long xcr0 = (osxsave ? _xgetbv(0) : 0);
+   bool ymm = ((xcr0 & 0x06) == 0x06);
+   bool zmm = ((xcr0 & 0xe6) == 0xe6);
+   bool avx2 = false;
+   bool avx512 = false;
+   if (maxLeaf >= 7)
+   {
+      __cpuidex(info, 7, 0);
+      avx2 = ((info[1] & (1 << 5)) != 0);
+      avx512 = ((info[1] & (1 << 16)) != 0);
+   }
+   if (avx512 && zmm)
+   {
+      return i_avx512;
+   }
+   if (avx2 && avx && ymm)
+   {
+      return i_avx2;
+   }
+   if (sse4)
+   {
+      return i_sse4;
+   }
+#endif
+   return i_scalar;
+}
+
+static int FindKernels(const char *name)
+{
+   for (int i=0; AllKernels[i].name != NULL; ++i)
+   {
+      if (!strcmp(name, AllKernels[i].name))
+      {
+         return i;
+      }
+   }
+   return -1;
+}
+
+static char gKernelsWarning[256] = {0};
+
+static const NoiseKernels* SelectKernels()
+{
+   int isa = SupportedIsa();
+
+   // SEEXPR_NOISE_ISA can only lower the instruction set
+   const char *forced = getenv("SEEXPR_NOISE_ISA");
+   if (forced && forced[0] != '\0')
+   {
+      int i = FindKernels(forced);
+      if (i < 0)
+      {
+         snprintf(gKernelsWarning, sizeof(gKernelsWarning), "Unknown SEEXPR_NOISE_ISA value \"%s\" (scalar, sse4, avx2 or avx512), using %s noise kernels", forced, AllKernels[isa].name);
+      }
+      else if (i > isa)
+      {
+         snprintf(gKernelsWarning, sizeof(gKernelsWarning), "SEEXPR_NOISE_ISA requests %s noise kernels but the CPU only supports %s", forced, AllKernels[isa].name);
+      }
+      else
+      {
+         isa = i;
+      }
+   }
+
+   return &(AllKernels[isa]);
+}
+
+static const NoiseKernels *gKernels = SelectKernels();
+
+// ---
+
+static inline int ClampOctaves(int octaves)
+{
+   return std::max(1, std::min(octaves, SEEXPR_NOISE_MAX_OCTAVES));
+}
+
+// SeExpr's FBM<3, dim, turbulence>, octaves already clamped
+//   Octave positions are computed in sequence, all noise lookups then go
+//   through the kernel at once and are summed in SeExpr's order
+static void Fbm(const double *in, int dim, int octaves, double lacunarity, double gain, bool turbulence, double *out)
+{
+   const int size = 3 * SEEXPR_NOISE_MAX_OCTAVES + SEEXPR_NOISE_PAD;
+   double x[size];
+   double y[size];
+   double z[size];
+   double n[size];
+
+   double P[3] = {in[0], in[1], in[2]};
+   int count = 0;
+
+   for (int o=0; o<octaves; ++o)
+   {
+      // Noise<3, dim> offsets its own copy of P for each output dimension
+      double Q[3] = {P[0], P[1], P[2]};
+      for (int d=0; d<dim; ++d)
+      {
+         x[count] = Q[0];
+         y[count] = Q[1];
+         z[count] = Q[2];
+         ++count;
+         for (int k=0; k<3; ++k)
+         {
+            Q[k] += 1000.0;
+         }
+      }
+      for (int k=0; k<3; ++k)
+      {
+         P[k] *= lacunarity;
+         P[k] += 1234.0;
+      }
+   }
+   for (int i=count; i<size; ++i)
+   {
+      x[i] = y[i] = z[i] = 0.0;
+   }
+
+   gKernels->noise(x, y, z, count, n);
+
+   double scale = 1.0;
+   for (int d=0; d<dim; ++d)
+   {
+      out[d] = 0.0;
+   }
+   for (int o=0; o<octaves; ++o)
+   {
+      for (int d=0; d<dim; ++d)
+      {
+         double v = n[o * dim + d];
+         out[d] += (turbulence ? std::fabs(v) : v) * scale;
+      }
+      scale *= gain;
+   }
+}
+
+// SeExpr's ccellnoise for the 27 cells around P, indices offset by 1000
+//   per output dimension as in CellNoise<3, 3>
+static void CellNoiseNeighbours(const double *cell, double (*values)[3])
+{
+   const int size = 27 * 3 + SEEXPR_NOISE_PAD - (27 * 3) % SEEXPR_NOISE_PAD;
+   int x[size];
+   int y[size];
+   int z[size];
+   double n[size];
+
+   int count = 0;
+
+   for (int i=-1; i<=1; ++i)
+   {
+      for (int j=-1; j<=1; ++j)
+      {
+         for (int k=-1; k<=1; ++k)
+         {
+            uint32_t ix = uint32_t(int64_t(std::floor(cell[0] + i)));
+            uint32_t iy = uint32_t(int64_t(std::floor(cell[1] + j)));
+            uint32_t iz = uint32_t(int64_t(std::floor(cell[2] + k)));
+            for (int d=0; d<3; ++d, ++count)
+            {
+               x[count] = int(ix);
+               y[count] = int(iy);
+               z[count] = int(iz);
+               ix += 1000;
+               iy += 1000;
+               iz += 1000;
+            }
+         }
+      }
+   }
+   for (int i=count; i<size; ++i)
+   {
+      x[i] = y[i] = z[i] = 0;
+   }
+
+   gKernels->cellnoise(x, y, z, count, n);
+
+   for (int c=0; c<27; ++c)
+   {
+      for (int d=0; d<3; ++d)
+      {
+         values[c][d] = n[3 * c + d];
+      }
+   }
+}
+
+// SeExpr's ccellnoise at a single point
+static void CellNoise3(const double *P, double *out)
+{
+   int x[3];
+   int y[3];
+   int z[3];
+   uint32_t ix = uint32_t(int64_t(std::floor(P[0])));
+   uint32_t iy = uint32_t(int64_t(std::floor(P[1])));
+   uint32_t iz = uint32_t(int64_t(std::floor(P[2])));
+   for (int d=0; d<3; ++d)
+   {
+      x[d] = int(ix);
+      y[d] = int(iy);
+      z[d] = int(iz);
+      ix += 1000;
+      iy += 1000;
+      iz += 1000;
+   }
+   Scalar::CellNoise(x, y, z, 3, out);
+}
+
+static double SmoothStep(double x, double a, double b)
+{
+   if (a < b)
+   {
+      if (x < a)
+      {
+         return 0.0;
+      }
+      if (x >= b)
+      {
+         return 1.0;
+      }
+      x = (x - a) / (b - a);
+   }
+   else if (a > b)
+   {
+      if (x <= b)
+      {
+         return 1.0;
+      }
+      if (x > a)
+      {
+         return 0.0;
+      }
+      x = 1.0 - (x - b) / (a - b);
+   }
+   else
+   {
+      return (x < a ? 0.0 : 1.0);
+   }
+   return x * x * (3.0 - 2.0 * x);
+}
+
+static inline double Dot(const double *a, const double *b)
+{
+   return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+double NoiseFbm(const double *P, int octaves, double lacunarity, double gain)
+{
+   double result = 0.0;
+   Fbm(P, 1, ClampOctaves(octaves), lacunarity, gain, false, &result);
+   return 0.5 * result + 0.5;
+}
+
+double NoiseTurbulence(const double *P, int octaves, double lacunarity, double gain)
+{
+   double result = 0.0;
+   Fbm(P, 1, ClampOctaves(octaves), lacunarity, gain, true, &result);
+   return 0.5 * result + 0.5;
+}
+
+void NoiseVoronoi(const double *P, int type, double jitter, double fbmScale, int fbmOctaves, double fbmLacunarity, double fbmGain, double *result)
+{
+   double p[3] = {P[0], P[1], P[2]};
+
+   if (fbmScale > 0.0)
+   {
+      double fbmP[3] = {2.0 * p[0], 2.0 * p[1], 2.0 * p[2]};
+      double offset[3];
+      Fbm(fbmP, 3, ClampOctaves(fbmOctaves), fbmLacunarity, fbmGain, false, offset);
+      for (int k=0; k<3; ++k)
+      {
+         p[k] += fbmScale * offset[k];
+      }
+   }
+
+   // feature points of the 27 cells around p (from Advanced Renderman, page 257)
+   double thiscell[3];
+   for (int k=0; k<3; ++k)
+   {
+      thiscell[k] = std::floor(p[k]) + 0.5;
+   }
+
+   double jitters[27][3];
+   CellNoiseNeighbours(thiscell, jitters);
+
+   double f1 = 1000.0;
+   double f2 = 1000.0;
+   double pos1[3] = {0.0, 0.0, 0.0};
+   double pos2[3] = {0.0, 0.0, 0.0};
+   int n = 0;
+
+   for (int i=-1; i<=1; ++i)
+   {
+      for (int j=-1; j<=1; ++j)
+      {
+         for (int k=-1; k<=1; ++k, ++n)
+         {
+            double testcell[3] = {thiscell[0] + i, thiscell[1] + j, thiscell[2] + k};
+            double pos[3];
+            double offset[3];
+            for (int d=0; d<3; ++d)
+            {
+               pos[d] = testcell[d] + jitter * (jitters[n][d] - 0.5);
+               offset[d] = pos[d] - p[d];
+            }
+            double dist = Dot(offset, offset);
+            if (dist < f1)
+            {
+               f2 = f1;
+               std::copy(pos1, pos1 + 3, pos2);
+               f1 = dist;
+               std::copy(pos, pos + 3, pos1);
+            }
+            else if (dist < f2)
+            {
+               f2 = dist;
+               std::copy(pos, pos + 3, pos2);
+            }
+         }
+      }
+   }
+
+   f1 = std::sqrt(f1);
+   f2 = std::sqrt(f2);
+
+   double value = 0.0;
+
+   switch (type)
+   {
+   case 1:
+      pos1[0] += 10.0;
+      CellNoise3(pos1, result);
+      return;
+   case 2:
+      value = f1;
+      break;
+   case 3:
+      value = f2;
+      break;
+   case 4:
+      value = f2 - f1;
+      break;
+   case 5:
+      {
+         double d21[3] = {pos2[0] - pos1[0], pos2[1] - pos1[1], pos2[2] - pos1[2]};
+         double d1[3] = {pos1[0] - p[0], pos1[1] - p[1], pos1[2] - p[2]};
+         double d2[3] = {pos2[0] - p[0], pos2[1] - p[1], pos2[2] - p[2]};
+         float scalefactor = float(std::sqrt(Dot(d21, d21)) / (std::sqrt(Dot(d1, d1)) + std::sqrt(Dot(d2, d2))));
+         value = SmoothStep(f2 - f1, 0.0, 0.1 * scalefactor);
+      }
+      break;
+   default:
+      break;
+   }
+
+   result[0] = value;
+   result[1] = value;
+   result[2] = value;
+}
+
+const char* NoiseKernelsName()
+{
+   return gKernels->name;
+}
+
+const char* NoiseKernelsWarning()
+{
+   return (gKernelsWarning[0] != '\0' ? gKernelsWarning : 0);
+}
+
+bool NoiseUseKernels(const char *name)
+{
+   int i = FindKernels(name);
+   if (i < 0 || i > SupportedIsa())
+   {
+      return false;
+   }
+   gKernels = &(AllKernels[i]);
+   return true;
+}
@@ -0,0 +1,50 @@
+// Copyright 2014 Gaetan Guidet
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __seexpr_noise_h__
+#define __seexpr_noise_h__
+
+// SeExpr's fbm, turbulence and voronoi built-ins (see seexpr.cpp)
+//
+//   Same algorithms and tables as SeExpr's Noise.cpp (ported from its
+//   noiseHelper, hashReduce and FBM templates) and ExprBuiltins.cpp, with
+//   the lattice lookups done by kernels implemented for SSE4.1, AVX2 and
+//   AVX-512. The best set supported by the CPU is selected when the plugin
+//   is loaded. The SEEXPR_NOISE_ISA environment variable (scalar, sse4, avx2
+//   or avx512) can force a lower instruction set.
+//
+//   All kernels compute in double precision and match the scalar reference,
+//   itself checked against SeExpr's built-ins, within 1e-5 (absolute, see
+//   test/noise_test.cpp).
+
+// fbm(P, octaves, lacunarity, gain), octaves clamped to [1, 8]
+double NoiseFbm(const double *P, int octaves, double lacunarity, double gain);
+
+// turbulence(P, octaves, lacunarity, gain), octaves clamped to [1, 8]
+double NoiseTurbulence(const double *P, int octaves, double lacunarity, double gain);
+
+// voronoi(P, type, jitter, fbmScale, fbmOctaves, fbmLacunarity, fbmGain)
+//   jitter is expected in [1e-3, 1], result has 3 components
+void NoiseVoronoi(const double *P, int type, double jitter, double fbmScale, int fbmOctaves, double fbmLacunarity, double fbmGain, double *result);
+
+// Selected kernels instruction set
+const char* NoiseKernelsName();
+
+// Why SEEXPR_NOISE_ISA was ignored, NULL if it wasn't
+const char* NoiseKernelsWarning();
+
+// Select kernels by name (see SEEXPR_NOISE_ISA), fails if the CPU doesn't support them
+bool NoiseUseKernels(const char *name);
+
+#endif
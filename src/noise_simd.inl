@@ -0,0 +1,145 @@
+// Copyright 2014 Gaetan Guidet
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Noise kernels, included once per instruction set (see noise.cpp)
+//
+//   The including namespace defines NOISE_TARGET, the lane count W, the vd
+//   (double) and vi (W 32 bits integers) types and their operations. Each
+//   kernel performs the same operations, in the same order, as SeExpr's
+//   noiseHelper<3> and hashReduce<3> (Noise.cpp), one lookup per lane.
+
+// SeExpr's linear congruential blend and tempering permutation
+NOISE_TARGET static inline vi Temper(vi x, vi y, vi z)
+{
+   const vi M = Set1i(int(1664525u));
+   const vi C = Set1i(int(1013904223u));
+   // seed starts at 0
+   vi seed = Addi(x, C);
+   seed = Addi(Addi(Mulli(seed, M), y), C);
+   seed = Addi(Addi(Mulli(seed, M), z), C);
+   seed = Xori(seed, Srli<11>(seed));
+   seed = Xori(seed, Andi(Slli<7>(seed), Set1i(int(0x9d2c5680u))));
+   seed = Xori(seed, Andi(Slli<15>(seed), Set1i(int(0xefc60000u))));
+   return Xori(seed, Srli<18>(seed));
+}
+
+// hashReduceChar<3>
+NOISE_TARGET static inline vi HashChar(vi x, vi y, vi z)
+{
+   const vi mask = Set1i(0xff);
+   vi seed = Temper(x, y, z);
+   return Andi(Addi(Srli<4>(Andi(seed, Set1i(0xff0000))), Andi(seed, mask)), mask);
+}
+
+// hashReduce<3>
+NOISE_TARGET static inline vi Hash(vi x, vi y, vi z)
+{
+   const vi mask = Set1i(0xff);
+   vi seed = Temper(x, y, z);
+   vi c3 = Gatheri(Perm, Andi(seed, mask));
+   vi c2 = Gatheri(Perm, Andi(Addi(Andi(Srli<8>(seed), mask), c3), mask));
+   vi c1 = Gatheri(Perm, Andi(Addi(Andi(Srli<16>(seed), mask), c2), mask));
+   vi c0 = Gatheri(Perm, Andi(Addi(Srli<24>(seed), c1), mask));
+   return Ori(Ori(Slli<24>(c3), Slli<16>(c2)), Ori(Slli<8>(c1), c0));
+}
+
+// Quintic interpolant (s_curve)
+NOISE_TARGET static inline vd Fade(vd t)
+{
+   return Mul(Mul(Mul(t, t), t), Add(Mul(t, Sub(Mul(Set1(6.0), t), Set1(15.0))), Set1(10.0)));
+}
+
+// beta * a + alpha * b
+NOISE_TARGET static inline vd Blend(vd alpha, vd beta, vd a, vd b)
+{
+   return Add(Mul(beta, a), Mul(alpha, b));
+}
+
+// Gradient at corner (ix, iy, iz) dotted with the weights
+NOISE_TARGET static inline vd Corner(vi ix, vi iy, vi iz, vd wx, vd wy, vd wz)
+{
+   vi lookup = HashChar(ix, iy, iz);
+   vi offset = Addi(Addi(lookup, lookup), lookup);
+   vd val = Mul(Gather(Gradients, offset), wx);
+   val = Add(val, Mul(Gather(Gradients + 1, offset), wy));
+   return Add(val, Mul(Gather(Gradients + 2, offset), wz));
+}
+
+// noiseHelper<3>, count values rounded up to a multiple of W (arrays are padded)
+NOISE_TARGET static void Noise(const double *x, const double *y, const double *z, int count, double *out)
+{
+   const vd one = Set1(1.0);
+   const vi ione = Set1i(1);
+
+   for (int i=0; i<count; i+=W)
+   {
+      vd px = Load(x + i);
+      vd py = Load(y + i);
+      vd pz = Load(z + i);
+      vd flx = Floor(px);
+      vd fly = Floor(py);
+      vd flz = Floor(pz);
+      vi ix0 = CvtI(flx);
+      vi iy0 = CvtI(fly);
+      vi iz0 = CvtI(flz);
+      vi ix1 = Addi(ix0, ione);
+      vi iy1 = Addi(iy0, ione);
+      vi iz1 = Addi(iz0, ione);
+      vd wx0 = Sub(px, flx);
+      vd wy0 = Sub(py, fly);
+      vd wz0 = Sub(pz, flz);
+      vd wx1 = Sub(wx0, one);
+      vd wy1 = Sub(wy0, one);
+      vd wz1 = Sub(wz0, one);
+
+      // corners in SeExpr's order: x offset in bit 0, y in bit 1, z in bit 2
+      vd v0 = Corner(ix0, iy0, iz0, wx0, wy0, wz0);
+      vd v1 = Corner(ix1, iy0, iz0, wx1, wy0, wz0);
+      vd v2 = Corner(ix0, iy1, iz0, wx0, wy1, wz0);
+      vd v3 = Corner(ix1, iy1, iz0, wx1, wy1, wz0);
+      vd v4 = Corner(ix0, iy0, iz1, wx0, wy0, wz1);
+      vd v5 = Corner(ix1, iy0, iz1, wx1, wy0, wz1);
+      vd v6 = Corner(ix0, iy1, iz1, wx0, wy1, wz1);
+      vd v7 = Corner(ix1, iy1, iz1, wx1, wy1, wz1);
+
+      vd ax = Fade(wx0);
+      vd ay = Fade(wy0);
+      vd az = Fade(wz0);
+      vd bx = Sub(one, ax);
+      vd by = Sub(one, ay);
+      vd bz = Sub(one, az);
+
+      v0 = Blend(ax, bx, v0, v1);
+      v2 = Blend(ax, bx, v2, v3);
+      v4 = Blend(ax, bx, v4, v5);
+      v6 = Blend(ax, bx, v6, v7);
+      v0 = Blend(ay, by, v0, v2);
+      v4 = Blend(ay, by, v4, v6);
+
+      Store(out + i, Blend(az, bz, v0, v4));
+   }
+}
+
+// hashReduce<3> of integer lattice coordinates, in [0, 1]
+//   count values rounded up to a multiple of W (arrays are padded)
+NOISE_TARGET static void CellNoise(const int *x, const int *y, const int *z, int count, double *out)
+{
+   const vd scale = Set1(1.0 / 0xffffffffu);
+
+   for (int i=0; i<count; i+=W)
+   {
+      vi h = Hash(Loadi(x + i), Loadi(y + i), Loadi(z + i));
+      Store(out + i, Mul(CvtU(h), scale));
+   }
+}
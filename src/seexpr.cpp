@@ -13,13 +13,27 @@
 // limitations under the License.
 
 #include <ai.h>
+#include <SeExpr2/ExprConfig.h>
 #include <SeExpr2/Expression.h>
 #include <SeExpr2/VarBlock.h>
+#include <SeExpr2/ExprNode.h>
+#include <SeExpr2/ExprFunc.h>
+#include <SeExpr2/Curve.h>
+#include "noise.h"
 #include <cstring>
 #include <cstdio>
 #include <map>
 #include <vector>
 #include <string>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <thread>
+#include <condition_variable>
+#include <deque>
 
 AI_SHADER_NODE_EXPORT_METHODS(SeExprMtd);
 
@@ -31,29 +45,633 @@ enum SeExpParams
    p_vparam_name,
    p_vparam_value,
    p_stop_on_error,
-   p_error_value
+   p_error_value,
+   p_backend,
+   p_output_names,
+   p_curve_resolution
 };
 
+enum SeExprBackend
+{
+   b_interpreter = 0,
+   b_llvm
+};
+
+static const char* SeExprBackendNames[] =
+{
+   "interpreter",
+   "llvm",
+   NULL
+};
+
+// Shader globals fixed for the whole render (see ArnoldSgVar::isRenderConstant)
+//   Read from options and camera on every node update and stored per node,
+//   never in the compiled expression as it outlives updates (see ExprCache)
+struct RenderConstants
+{
+   float frame;
+   float fps;
+   float motionStart; // sample_frame range
+   float motionEnd;
+   float shutterOpenTime;
+   float shutterCloseTime;
+   float shutterOpenFrame;
+   float shutterCloseFrame;
+
+   // Only reads values for the shader globals in mask (see ArnoldExpr::renderConstants)
+   void read(unsigned long long mask);
+   double value(int which) const;
+};
+
+// Upstream connections of a fparam_value/vparam_value element
+//   Vector elements are either linked as a whole (first entry only) or per
+//   component (x, y, z)
+struct ParamLink
+{
+   AtNode *node[3];
+   int type[3]; // upstream output type
+   int comp[3]; // upstream output component (-1 for whole output)
+   bool linked;
+   bool whole;
+};
+
+// External variables binding state (one per thread)
+//   The compiled expression and its variable references are shared by all
+//   threads, everything that depends on the shading context lives here
+struct ArnoldBindings
+{
+   AtNode *node;
+   AtShaderGlobals *sg;
+   AtArray *fvalues;
+   AtArray *vvalues;
+   const ParamLink *links; // per variable (floats then vectors), evaluated on first read
+   unsigned int sample; // current evaluation stamp
+   std::vector<unsigned int> linkStamps; // evaluation stamp of linkValues
+   std::vector<double> linkValues; // 3 per variable
+   std::vector<int> userTypes;
+   const RenderConstants *constants; // node render constants
+   std::vector<const AtNode*> userShapes; // shape userTypes were resolved for
+   class ShapeTypeCache *shapeTypes; // node user data types (see ArnoldUserVar::fetch)
+   std::vector<double> sgValues; // referenced shader globals (VarBlock storage)
+   AtTextureHandle **textures; // node texture handles (see ArnoldExpr::texturePaths)
+};
+
+// Bindings for the expression currently evaluated by this thread
+static thread_local ArnoldBindings *gBindings = 0;
+
+#define SEEXPR_CACHE_LINE_SIZE 64
+
+// Identifies a shading point: Arnold calls shader_evaluate once per link
+//   when a node feeds several inputs, all with the same shading context
+//   The referenced shader globals are compared separately, from their copy
+//   in VarBlock storage (see SeExprThreadData::memoSgValues), this only holds
+//   the context of the lookups that read the shader globals by themselves
+struct ShadingPointKey
+{
+   const AtShaderGlobals *sg;
+   const AtNode *Op;
+   // user data interpolation (only set when user variables are referenced)
+   unsigned int fi;
+   float u;
+   float v;
+   float bu;
+   float bv;
+   float time;
+
+   // memset first so that padding compares equal
+   void set(const AtShaderGlobals *_sg, bool userData)
+   {
+      memset(this, 0, sizeof(ShadingPointKey));
+      sg = _sg;
+      Op = _sg->Op;
+      if (userData)
+      {
+         fi = _sg->fi;
+         u = _sg->u;
+         v = _sg->v;
+         bu = _sg->bu;
+         bv = _sg->bv;
+         time = _sg->time;
+      }
+   }
+
+   inline bool operator==(const ShadingPointKey &rhs) const
+   {
+      return (memcmp(this, &rhs, sizeof(ShadingPointKey)) == 0);
+   }
+};
+
+// Shading query a thread output was computed for (see SeExprGetOutput)
+//   Named output selectors read their source output after another link
+//   evaluated it, possibly followed by evaluations for another ray, sample
+//   or light on the same thread. Unlike ShadingPointKey, this holds the
+//   globals identifying the query whatever the expression reads
+struct OutputStamp
+{
+   const AtShaderGlobals *sg;
+   const AtNode *Op;
+   AtPoint P;
+   AtVector N;
+   AtVector Rd;
+   float u;
+   float v;
+   float bu;
+   float bv;
+   unsigned int fi;
+   float time;
+   int x;
+   int y;
+   float sx;
+   float sy;
+   AtUInt16 Rt;
+   AtByte Rr;
+   AtVector Ld;
+   AtColor Li;
+   float Ldist;
+
+   // memset first so that padding compares equal
+   void set(const AtShaderGlobals *_sg)
+   {
+      memset(this, 0, sizeof(OutputStamp));
+      sg = _sg;
+      Op = _sg->Op;
+      P = _sg->P;
+      N = _sg->N;
+      Rd = _sg->Rd;
+      u = _sg->u;
+      v = _sg->v;
+      bu = _sg->bu;
+      bv = _sg->bv;
+      fi = _sg->fi;
+      time = _sg->time;
+      x = _sg->x;
+      y = _sg->y;
+      sx = _sg->sx;
+      sy = _sg->sy;
+      Rt = _sg->Rt;
+      Rr = _sg->Rr;
+      Ld = _sg->Ld;
+      Li = _sg->Li;
+      Ldist = _sg->Ldist;
+   }
+
+   inline bool operator==(const OutputStamp &rhs) const
+   {
+      return (memcmp(this, &rhs, sizeof(OutputStamp)) == 0);
+   }
+};
+
+// Evaluation statistics (see 'seexpr_stats'), counted per thread
+//   Times are binned in 8 buckets per power of 2 nanoseconds so that
+//   percentiles are known within 12.5% without keeping every sample
+struct EvalStats
+{
+   enum
+   {
+      NumBuckets = 256 // up to 2^33 ns
+   };
+
+   unsigned long long evaluations;
+   unsigned long long constantHits; // evaluations using the constant output
+   unsigned long long errors;
+   unsigned long long totalTime; // nanoseconds
+   unsigned long long maxTime;
+   unsigned int histogram[NumBuckets];
+
+   EvalStats()
+   {
+      reset();
+   }
+
+   void reset()
+   {
+      evaluations = 0;
+      constantHits = 0;
+      errors = 0;
+      totalTime = 0;
+      maxTime = 0;
+      memset(histogram, 0, sizeof(histogram));
+   }
+
+   inline void add(unsigned long long ns, bool constant, bool error)
+   {
+      evaluations += 1;
+      constantHits += (constant ? 1 : 0);
+      errors += (error ? 1 : 0);
+      totalTime += ns;
+      maxTime = std::max(maxTime, ns);
+      histogram[Bucket(ns)] += 1;
+   }
+
+   void merge(const EvalStats &rhs)
+   {
+      evaluations += rhs.evaluations;
+      constantHits += rhs.constantHits;
+      errors += rhs.errors;
+      totalTime += rhs.totalTime;
+      maxTime = std::max(maxTime, rhs.maxTime);
+      for (int i=0; i<NumBuckets; ++i)
+      {
+         histogram[i] += rhs.histogram[i];
+      }
+   }
+
+   // Upper bound of the bucket holding the p-th percentile (p in [0, 1])
+   unsigned long long percentile(double p) const
+   {
+      if (evaluations == 0)
+      {
+         return 0;
+      }
+      unsigned long long rank = std::max(1ULL, (unsigned long long)(p * double(evaluations) + 0.5));
+      unsigned long long count = 0;
+      for (int i=0; i<NumBuckets; ++i)
+      {
+         count += histogram[i];
+         if (count >= rank)
+         {
+            return std::min(maxTime, BucketEnd(i));
+         }
+      }
+      return maxTime;
+   }
+
+   static inline int Bucket(unsigned long long ns)
+   {
+      if (ns < 8)
+      {
+         return int(ns);
+      }
+      int msb = 3;
+      while ((ns >> (msb + 1)) != 0 && msb < 33)
+      {
+         ++msb;
+      }
+      if ((ns >> (msb + 1)) != 0)
+      {
+         return NumBuckets - 1;
+      }
+      return 8 * (msb - 2) + int((ns >> (msb - 3)) & 7);
+   }
+
+   // Exclusive
+   static inline unsigned long long BucketEnd(int bucket)
+   {
+      if (bucket < 8)
+      {
+         return (unsigned long long)(bucket + 1);
+      }
+      int msb = bucket / 8 + 2;
+      return (unsigned long long)(8 + bucket % 8 + 1) << (msb - 3);
+   }
+};
+
+// Per-thread evaluation context
+//   Contexts are aligned and padded to a cache line so that threads shading
+//   the same node never write to a shared line. The VarBlock is stored in
+//   place for the same reason (its indirect index is written on every eval)
+struct alignas(SEEXPR_CACHE_LINE_SIZE) SeExprThreadData
+{
+   class ArnoldExpr *expr; // private expression object (thread unsafe expressions only)
+   SeExpr2::VarBlock *varBlock; // constructed in varBlockStorage
+   double *output; // returnDim values (see outputStorage)
+   std::vector<double> outputStorage;
+   OutputStamp outputStamp; // shading query output was computed for (named outputs only)
+   bool outputStamped;
+   ArnoldBindings bindings; // initialized by the owning thread on first evaluation
+   double mutexWaitTime; // time spent waiting on mutex in milliseconds
+   unsigned long long serializedEvals; // evaluations run under the node mutex (contended or not)
+   ShadingPointKey memoKey; // shading point output was last computed for
+   std::vector<double> memoSgValues; // referenced shader globals for memoKey
+   bool memoValid;
+   unsigned long long memoHits;
+   unsigned long long memoMisses;
+   EvalStats stats; // only updated when statistics are enabled
+   void *mem; // memory block the context is allocated in
+   std::aligned_storage<sizeof(SeExpr2::VarBlock), alignof(SeExpr2::VarBlock)>::type varBlockStorage;
+};
+
+// Per-thread objects (contexts, statistics) indexed by Arnold thread id
+//   Objects are only created for the threads that shade the node, by the
+//   thread itself on its first evaluation. Ids are spread over buckets of
+//   doubling size so that the table grows without moving existing entries:
+//   a lookup is two atomic loads, a bucket is published once with a
+//   compare-and-swap whichever thread needs it first
+template <typename T>
+class ThreadDataRegistry
+{
+public:
+
+   ThreadDataRegistry()
+   {
+      for (int b=0; b<NumBuckets; ++b)
+      {
+         mBuckets[b].store(0, std::memory_order_relaxed);
+      }
+   }
+
+   ~ThreadDataRegistry()
+   {
+      Clear();
+   }
+
+   inline T* Get(int tid) const
+   {
+      int b, i;
+      Locate(tid, b, i);
+      Slot *bucket = mBuckets[b].load(std::memory_order_acquire);
+      return (bucket ? bucket[i].load(std::memory_order_acquire) : 0);
+   }
+
+   // Only called by thread tid (or while no thread evaluates the node)
+   void Set(int tid, T *td)
+   {
+      int b, i;
+      Locate(tid, b, i);
+      Slot *bucket = mBuckets[b].load(std::memory_order_acquire);
+      if (!bucket)
+      {
+         size_t size = size_t(FirstBucketSize) << b;
+         Slot *newBucket = new Slot[size];
+         for (size_t j=0; j<size; ++j)
+         {
+            newBucket[j].store(0, std::memory_order_relaxed);
+         }
+         if (mBuckets[b].compare_exchange_strong(bucket, newBucket, std::memory_order_acq_rel))
+         {
+            bucket = newBucket;
+         }
+         else
+         {
+            // Another thread published the bucket first (bucket was updated)
+            delete[] newBucket;
+         }
+      }
+      bucket[i].store(td, std::memory_order_release);
+   }
+
+   template <typename Func>
+   void ForEach(Func func) const
+   {
+      for (int b=0; b<NumBuckets; ++b)
+      {
+         Slot *bucket = mBuckets[b].load(std::memory_order_acquire);
+         if (bucket)
+         {
+            size_t size = size_t(FirstBucketSize) << b;
+            for (size_t j=0; j<size; ++j)
+            {
+               T *td = bucket[j].load(std::memory_order_acquire);
+               if (td)
+               {
+                  func(td);
+               }
+            }
+         }
+      }
+   }
+
+   // Objects are owned by the caller, destroy them first
+   void Clear()
+   {
+      for (int b=0; b<NumBuckets; ++b)
+      {
+         delete[] mBuckets[b].exchange(0, std::memory_order_acq_rel);
+      }
+   }
+
+private:
+
+   typedef std::atomic<T*> Slot;
+
+   // Covers thread ids up to FirstBucketSize * (2^NumBuckets - 1)
+   enum
+   {
+      FirstBucketSize = 8,
+      NumBuckets = 28
+   };
+
+   // Bucket b holds ids [FirstBucketSize * (2^b - 1), FirstBucketSize * (2^(b+1) - 1))
+   static inline void Locate(int tid, int &bucket, int &index)
+   {
+      unsigned int n = unsigned(tid) / FirstBucketSize + 1;
+      bucket = 0;
+      while (n > 1)
+      {
+         n >>= 1;
+         ++bucket;
+      }
+      index = tid - FirstBucketSize * ((1 << bucket) - 1);
+   }
+
+   std::atomic<Slot*> mBuckets[NumBuckets];
+};
+
+// Resolved user data type per shape (sg->Op) and user variable
+//   Owned by the node and cleared on each of its updates so that a shape
+//   deleted during IPR can't leave its types to another node allocated at
+//   the same address. Open addressed tables of doubling size, allocated on
+//   demand and never moved: lookups are atomic loads only, new entries are
+//   claimed with a compare-and-swap on the shape then published with their
+//   slot. Threads only look up a shape when it differs from their previous
+//   one. Being a cache, a lost race only costs another type probe
+class ShapeTypeCache
+{
+public:
+   
+   ShapeTypeCache()
+   {
+      for (int t=0; t<NumTables; ++t)
+      {
+         mTables[t].store(0, std::memory_order_relaxed);
+      }
+   }
+   
+   ~ShapeTypeCache()
+   {
+      clear();
+   }
+   
+   // Returns AI_TYPE_UNDEFINED if shape type hasn't been resolved yet
+   int get(const AtNode *shape, size_t slot) const
+   {
+      for (int t=0; t<NumTables; ++t)
+      {
+         Cell *table = mTables[t].load(std::memory_order_acquire);
+         if (!table)
+         {
+            break;
+         }
+         size_t mask = (size_t(FirstTableSize) << t) - 1;
+         size_t h = hash(shape, slot);
+         for (int p=0; p<MaxProbes; ++p)
+         {
+            const Cell &cell = table[(h + p) & mask];
+            const AtNode *cshape = cell.shape.load(std::memory_order_acquire);
+            if (!cshape)
+            {
+               // cells are never released (but on clear), no later entry
+               return AI_TYPE_UNDEFINED;
+            }
+            if (cshape == shape && cell.slot.load(std::memory_order_acquire) == slot + 1)
+            {
+               return cell.type.load(std::memory_order_relaxed);
+            }
+         }
+      }
+      return AI_TYPE_UNDEFINED;
+   }
+   
+   // Overwrites any previous type (AI_TYPE_UNDEFINED to forget it)
+   void set(const AtNode *shape, size_t slot, int type)
+   {
+      for (int t=0; t<NumTables; ++t)
+      {
+         Cell *table = this->table(t);
+         size_t mask = (size_t(FirstTableSize) << t) - 1;
+         size_t h = hash(shape, slot);
+         for (int p=0; p<MaxProbes; ++p)
+         {
+            Cell &cell = table[(h + p) & mask];
+            const AtNode *cshape = cell.shape.load(std::memory_order_acquire);
+            if (!cshape)
+            {
+               if (cell.shape.compare_exchange_strong(cshape, shape, std::memory_order_acq_rel))
+               {
+                  cell.type.store(type, std::memory_order_relaxed);
+                  cell.slot.store(slot + 1, std::memory_order_release);
+                  return;
+               }
+               // claimed by another thread in the meantime (cshape was updated)
+            }
+            if (cshape == shape && cell.slot.load(std::memory_order_acquire) == slot + 1)
+            {
+               cell.type.store(type, std::memory_order_relaxed);
+               return;
+            }
+         }
+      }
+      // all tables full, types are probed on every shape change
+   }
+   
+   // Only called while no thread evaluates the node
+   void clear()
+   {
+      for (int t=0; t<NumTables; ++t)
+      {
+         delete[] mTables[t].exchange(0, std::memory_order_acq_rel);
+      }
+   }
+   
+private:
+   
+   enum
+   {
+      FirstTableSize = 64, // power of 2
+      NumTables = 20,
+      MaxProbes = 16
+   };
+   
+   struct Cell
+   {
+      std::atomic<const AtNode*> shape;
+      std::atomic<size_t> slot; // slot + 1, 0 until published
+      std::atomic<int> type;
+   };
+   
+   static inline size_t hash(const AtNode *shape, size_t slot)
+   {
+      size_t h = (reinterpret_cast<size_t>(shape) >> 4) * 31 + slot;
+      return (h ^ (h >> 7) ^ (h >> 15));
+   }
+   
+   Cell* table(int t)
+   {
+      Cell *table = mTables[t].load(std::memory_order_acquire);
+      if (!table)
+      {
+         size_t size = size_t(FirstTableSize) << t;
+         Cell *newTable = new Cell[size];
+         for (size_t i=0; i<size; ++i)
+         {
+            newTable[i].shape.store(0, std::memory_order_relaxed);
+            newTable[i].slot.store(0, std::memory_order_relaxed);
+            newTable[i].type.store(AI_TYPE_UNDEFINED, std::memory_order_relaxed);
+         }
+         if (mTables[t].compare_exchange_strong(table, newTable, std::memory_order_acq_rel))
+         {
+            table = newTable;
+         }
+         else
+         {
+            // Another thread published the table first (table was updated)
+            delete[] newTable;
+         }
+      }
+      return table;
+   }
+   
+   std::atomic<Cell*> mTables[NumTables];
+};
+
+
 struct SeExprData
 {
-   class ArnoldExpr** exprs; // expression objects array (up to one per thread)
+   class ArnoldExpr* expr; // compiled expression object (shared by all threads)
    bool valid;         // whether or not the expression is valid
    bool constant;      // whether or not the expression is constant (use value member)
    bool threadsafe;    // whether or not the expression is thread safe
    bool sgdependent;   // whether or not the expression depends on shader globals
-   AtCritSec mutex;    // mutex for thread unsafe shader globals dependent expressions
-   AtVector value;
+   bool memoize;       // whether or not the last output can be reused for the same shading point
+   AtCritSec mutex;    // mutex for expressions using functions with global state
+   std::vector<double> value; // constant output (see returnDim)
+   int outputType; // node entry output type (seexpr variants)
+   int outputDim; // main output dimension
+   int returnDim; // expression return type dimension (main output then 3 per named output)
+   std::vector<std::string> outputNames; // named outputs (local variables)
    unsigned int numfvars;
    unsigned int numvvars;
    std::map<std::string, unsigned int> varindex;
+   std::vector<bool> linked; // per variable (floats then vectors) input link state
+   std::vector<ParamLink> links; // per variable (floats then vectors)
+   AtArray *fvalues; // unlinked values
+   AtArray *vvalues;
+   RenderConstants constants; // read on setup
+   std::vector<double> paramValues; // unlinked parameters and render constants values (read only, shared by threads)
+   std::vector<double> foldValues; // hoisted uniform sub-expressions values
+   ShapeTypeCache shapeTypes; // cleared on update
+   std::vector<AtTextureHandle*> textures; // per constant texture path (see ArnoldExpr::texturePaths)
+   int curveResolution; // curve()/ccurve() table size
    bool stopOnError;
 
-   int nthreads;
-   SeExpr2::VarBlockCreator* varBlockCreator;
    int outputIndex;
-   double *outputData;
-   SeExpr2::VarBlock** varBlocks;
+   ThreadDataRegistry<SeExprThreadData> threads; // per-thread contexts (cache line aligned)
    std::string source;
+   std::string key; // expression cache key
+   int backend;
+   std::atomic<bool> pending; // compilation deferred to first evaluation
+   std::mutex compileMutex;
+   unsigned int compileJobs; // queued or running CompilePool jobs (guarded by pool)
+   bool stats; // collect evaluation statistics (see StatsReport)
+   EvalStats evalStats; // merged from per-thread contexts (see CollectThreadStats)
+   ThreadDataRegistry<EvalStats> constantStats; // per-thread statistics of constant nodes (no context)
+   unsigned long long memoHits;
+   unsigned long long memoMisses;
+   unsigned long long serializedEvals; // evaluations run under the node mutex
+   double mutexWaitTime; // milliseconds
+   unsigned int setups; // full expression setups
+   unsigned int rebinds; // parameter values only updates (see RebindExpr)
+   std::atomic<unsigned int> invalidEvals; // evaluations of an invalid expression (no thread context)
+};
+
+// Thread unsafe functions known to keep their state in the expression
+//   object (per call node data): a private expression per thread makes them
+//   safe. Any other thread unsafe function may share state beyond it (output
+//   streams, statics, custom plugins), its evaluations are serialized
+static const char* PrivateStateFunctions[] =
+{
+   "rand",
+   NULL
 };
 
 namespace SSTR
@@ -72,6 +690,14 @@ namespace SSTR
    extern AtString relative_motion_frame;
    extern AtString shutter_start;
    extern AtString shutter_end;
+   extern AtString backend;
+   extern AtString seexpr_backend;
+   extern AtString seexpr_lazy_compile;
+   extern AtString seexpr_compile_threads;
+   extern AtString seexpr_stats;
+   extern AtString seexpr_stats_file;
+   extern AtString output_names;
+   extern AtString curve_resolution;
 }
 
 // ---
@@ -291,23 +917,10 @@ public:
       : SeExpr2::ExprVarRef(SeExpr2::ExprType().Error().Varying())
       , mWhich(which)
       , mIsVec(false)
-      , mSgVarF(0)
-      , mSgVarV(0)
-      , mSgVarI(0)
-      , mSgVarD(0)
-      , mSgVarB(0)
-      , mSgVarC(0)
-      , mSgVarU16(0)
-      , mFrame(0.0f)
-      , mFPS(24.0f)
-      , mMotionStart(0.0f)
-      , mMotionEnd(0.0f)
-      , mSampleFrame(0.0f)
-      , mTime(0)
-      , mShutterOpenTime(0.0f)
-      , mShutterCloseTime(0.0f)
-      , mShutterOpenFrame(0.0f)
-      , mShutterCloseFrame(0.0f)
+      , mStorage(s_none)
+      , mOffset(0)
+      , mIndex(-1)
+      , mValueOffset(0)
    {
       if (mWhich < 0 || mWhich >= undefined)
       {
@@ -316,42 +929,41 @@ public:
       else
       {
          mIsVec = (mWhich <= vecmax);
-         setType(SeExpr2::ExprType().FP(mIsVec ? 3 : 1).Varying());
+         if (isRenderConstant())
+         {
+            setType(SeExpr2::ExprType().FP(1).Uniform());
+         }
+         else
+         {
+            setType(SeExpr2::ExprType().FP(mIsVec ? 3 : 1).Varying());
+         }
       }
-      initOptionsVar();
-      initCameraVar();
+      initBinding();
    }
 
    ArnoldSgVar(const std::string &name)
       : SeExpr2::ExprVarRef(SeExpr2::ExprType().Error().Varying())
       , mWhich(undefined)
       , mIsVec(false)
-      , mSgVarF(0)
-      , mSgVarV(0)
-      , mSgVarI(0)
-      , mSgVarD(0)
-      , mSgVarB(0)
-      , mSgVarC(0)
-      , mSgVarU16(0)
-      , mFrame(0.0f)
-      , mFPS(24.0f)
-      , mMotionStart(0.0f)
-      , mMotionEnd(0.0f)
-      , mSampleFrame(0.0f)
-      , mTime(0)
-      , mShutterOpenTime(0.0f)
-      , mShutterCloseTime(0.0f)
-      , mShutterOpenFrame(0.0f)
-      , mShutterCloseFrame(0.0f)
+      , mStorage(s_none)
+      , mOffset(0)
+      , mIndex(-1)
+      , mValueOffset(0)
    {
       mWhich = NameToEnum(name);
       if (mWhich != undefined)
       {
          mIsVec = (mWhich <= vecmax);
-         setType(SeExpr2::ExprType().FP(mIsVec ? 3 : 1).Varying());
+         if (isRenderConstant())
+         {
+            setType(SeExpr2::ExprType().FP(1).Uniform());
+         }
+         else
+         {
+            setType(SeExpr2::ExprType().FP(mIsVec ? 3 : 1).Varying());
+         }
       }
-      initOptionsVar();
-      initCameraVar();
+      initBinding();
    }
 
    virtual ~ArnoldSgVar()
@@ -365,373 +977,195 @@ public:
 
    virtual void eval(double *result)
    {
-      if (mWhich == sample_frame)
+      if (isRenderConstant())
       {
-         if (mTime)
-         {
-            mSampleFrame = mMotionStart + *mTime * (mMotionEnd - mMotionStart);
-         }
-         else
-         {
-            mSampleFrame = mMotionStart;
-         }
+         result[0] = (gBindings->constants ? gBindings->constants->value(mWhich) : 0.0);
+         return;
       }
       
-      if (mSgVarV)
-      {
-         result[0] = mSgVarV->x;
-         result[1] = mSgVarV->y;
-         result[2] = mSgVarV->z;
-      }
-      else if (mSgVarC)
-      {
-         result[0] = mSgVarC->r;
-         result[1] = mSgVarC->g;
-         result[2] = mSgVarC->b;
-      }
-      else if (mSgVarF)
-      {
-         result[0] = double(*mSgVarF);
-      }
-      else if (mSgVarD)
-      {
-         result[0] = *mSgVarD;
-      }
-      else if (mSgVarI)
-      {
-         result[0] = double(*mSgVarI);
-      }
-      else if (mSgVarU16)
-      {
-         result[0] = double(*mSgVarU16);
-      }
-      else if (mSgVarB)
-      {
-         result[0] = double(*mSgVarB);
-      }
-      else
+      read(gBindings->sg, *(gBindings->constants), result);
+   }
+
+   // Non virtual read used to fill VarBlock storage
+   inline void read(const AtShaderGlobals *sg, const RenderConstants &constants, double *result) const
+   {
+      const char *field = reinterpret_cast<const char*>(sg) + mOffset;
+      
+      switch (mStorage)
       {
-         result[0] = 0.0;
-         if (mIsVec)
+      case s_vector:
          {
-            result[1] = 0.0;
-            result[2] = 0.0;
+            const AtVector *v = reinterpret_cast<const AtVector*>(field);
+            result[0] = v->x;
+            result[1] = v->y;
+            result[2] = v->z;
          }
-      }
-   }
-   
-   bool getNodeConstantFloat(AtNode *node, AtString name, float &val, const char *msg=NULL) const
-   {
-      const AtUserParamEntry *pe = AiNodeLookUpUserParameter(node, name);
-      if (pe != 0)
-      {
-         int type = AiUserParamGetType(pe);
-         int cat = AiUserParamGetCategory(pe);
-         
-         if (cat == AI_USERDEF_CONSTANT)
-         {
-            switch (type)
-            {
-            case AI_TYPE_BYTE:
-               val = float(AiNodeGetByte(node, name));
-               break;
-            case AI_TYPE_INT:
-               val = float(AiNodeGetInt(node, name));
-               break;
-            case AI_TYPE_UINT:
-               val = float(AiNodeGetUInt(node, name));
-               break;
-            case AI_TYPE_FLOAT:
-               val = AiNodeGetFlt(node, name);
-               break;
-            default:
-               AiMsgWarning("[seexpr] \"%s\" parameter on node \"%s\" should be a float or an integer (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
-               return false;
-            }
-            return true;
-         }
-         else
-         {
-            AiMsgWarning("[seexpr] \"%s\" parameter on node \"%s\" must be a constant (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
-            return false;
-         }
-      }
-      else
-      {
-         AiMsgWarning("[seexpr] \"%s\" parameter not defined on node \"%s\" (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
-         return false;
-      }
-   }
-   
-   bool getNodeConstantBool(AtNode *node, AtString name, bool &val, const char *msg=NULL) const
-   {
-      const AtUserParamEntry *pe = AiNodeLookUpUserParameter(node, name);
-      if (pe != 0)
-      {
-         int type = AiUserParamGetType(pe);
-         int cat = AiUserParamGetCategory(pe);
-         
-         if (cat == AI_USERDEF_CONSTANT)
-         {
-            switch (type)
-            {
-            case AI_TYPE_BOOLEAN:
-               val = AiNodeGetBool(node, name);
-               break;
-            case AI_TYPE_BYTE:
-               val = (AiNodeGetByte(node, name) != 0);
-               break;
-            case AI_TYPE_INT:
-               val = (AiNodeGetInt(node, name) != 0);
-               break;
-            case AI_TYPE_UINT:
-               val = (AiNodeGetUInt(node, name) != 0);
-               break;
-            case AI_TYPE_FLOAT:
-               val = (AiNodeGetFlt(node, name) != 0.0f);
-               break;
-            default:
-               AiMsgWarning("[seexpr] \"%s\" parameter on node \"%s\" should be a boolean, an integer or a float (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
-               return false;
-            }
-            return true;
-         }
-         else
+         break;
+      case s_color:
          {
-            AiMsgWarning("[seexpr] \"%s\" parameter on node \"%s\" must be a constant (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
-            return false;
+            const AtColor *c = reinterpret_cast<const AtColor*>(field);
+            result[0] = c->r;
+            result[1] = c->g;
+            result[2] = c->b;
          }
-      }
-      else
-      {
-         AiMsgWarning("[seexpr] \"%s\" parameter not defined on node \"%s\" (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
-         return false;
-      }
-   }
-   
-   void initOptionsVar()
-   {
-      switch (mWhich)
-      {
-      case fps:
-         getNodeConstantFloat(AiUniverseGetOptions(), SSTR::fps, mFPS, "Defaults to 24");
          break;
-      case frame:
-         getNodeConstantFloat(AiUniverseGetOptions(), SSTR::frame, mFrame, "Defaults to 0");
+      case s_sample_frame:
+         result[0] = double(constants.motionStart + *reinterpret_cast<const float*>(field) * (constants.motionEnd - constants.motionStart));
          break;
-      case sample_frame:
-      case shutter_open_frame:
-      case shutter_close_frame:
-         {
-            bool relative = false;
-            float frame = 0.0f;
-            AtNode *opts = AiUniverseGetOptions();
-            if (getNodeConstantBool(opts, SSTR::relative_motion_frame, relative, "Defaults to false") && relative)
-            {
-               getNodeConstantFloat(opts, SSTR::frame, frame, "Defaults to 0");
-            }
-            if (!getNodeConstantFloat(opts, SSTR::motion_start_frame, mMotionStart, "Defaults to 'frame'"))
-            {
-               if (relative)
-               {
-                  // already have value in frame variable
-                  mMotionStart = frame;
-               }
-               else
-               {
-                  getNodeConstantFloat(opts, SSTR::frame, mMotionStart, "Defaults to 0");
-               }
-            }
-            else
-            {
-               mMotionStart += frame;
-            }
-            if (!getNodeConstantFloat(opts, SSTR::motion_end_frame, mMotionEnd, "Defaults to 'motion_start_frame'"))
-            {
-               mMotionEnd = mMotionStart;
-            }
-            else
-            {
-               mMotionEnd += frame;
-            }
-         }
+      case s_float:
+         result[0] = double(*reinterpret_cast<const float*>(field));
+         break;
+      case s_double:
+         result[0] = *reinterpret_cast<const double*>(field);
+         break;
+      case s_int:
+         result[0] = double(*reinterpret_cast<const int*>(field));
+         break;
+      case s_uint16:
+         result[0] = double(*reinterpret_cast<const AtUInt16*>(field));
+         break;
+      case s_byte:
+         result[0] = double(*reinterpret_cast<const AtByte*>(field));
          break;
       default:
+         result[0] = 0.0;
+         if (mIsVec)
+         {
+            result[1] = 0.0;
+            result[2] = 0.0;
+         }
          break;
       }
    }
    
-   void initCameraVar()
+   // Values fixed for the whole render (from options and camera), stored per
+   //   node as uniform VarBlock variables (see RenderConstants)
+   inline bool isRenderConstant() const
    {
-      // Note: must init options var first
       switch (mWhich)
       {
+      case frame:
+      case fps:
       case shutter_open_time:
-      case shutter_open_frame:
       case shutter_close_time:
+      case shutter_open_frame:
       case shutter_close_frame:
-         {
-            mShutterOpenFrame = mMotionStart;
-            mShutterCloseFrame = mShutterOpenFrame;
-            
-            AtNode *cam = AiUniverseGetCamera();
-            
-            if (cam)
-            {
-               mShutterOpenTime = AiNodeGetFlt(cam, SSTR::shutter_start);
-               mShutterCloseTime = AiNodeGetFlt(cam, SSTR::shutter_end);
-               
-               float motionLength = mMotionEnd - mMotionStart;
-               
-               if (motionLength > 0.0f)
-               {
-                  mShutterOpenFrame = mMotionStart + mShutterOpenTime * motionLength;
-                  mShutterCloseFrame = mMotionStart + mShutterCloseTime * motionLength;
-               }
-            }
-            else
-            {
-               mShutterOpenTime = 0.0f;
-               mShutterCloseTime = mShutterOpenTime;
-            }
-         }
-         break;
+         return true;
       default:
-         break;
+         return false;
       }
    }
-   
-   bool bind(AtNode *, AtShaderGlobals *sg)
-   {
-      mSgVarF = 0;
-      mSgVarV = 0;
-      mSgVarI = 0;
-      mSgVarD = 0;
-      mSgVarB = 0;
-      mSgVarC = 0;
-      mSgVarU16 = 0;
 
+   // Shader globals field read by eval, resolved once
+   void initBinding()
+   {
+      mStorage = s_none;
+      mOffset = 0;
+      
       if (mWhich != undefined)
       {
          switch (mWhich)
          {
          case P:
-            mSgVarV = &(sg->P); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, P)); break;
          case Po:
-            mSgVarV = &(sg->Po); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, Po)); break;
          case N:
-            mSgVarV = &(sg->N); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, N)); break;
          case Nf:
-            mSgVarV = &(sg->Nf); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, Nf)); break;
          case Ng:
-            mSgVarV = &(sg->Ng); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, Ng)); break;
          case Ngf:
-            mSgVarV = &(sg->Ngf); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, Ngf)); break;
          case Ns:
-            mSgVarV = &(sg->Nf); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, Nf)); break;
          case Ro:
-            mSgVarV = &(sg->Ro); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, Ro)); break;
          case Rd:
-            mSgVarV = &(sg->Rd); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, Rd)); break;
          case dPdx:
-            mSgVarV = &(sg->dPdx); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, dPdx)); break;
          case dPdy:
-            mSgVarV = &(sg->dPdy); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, dPdy)); break;
          case dPdu:
-            mSgVarV = &(sg->dPdu); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, dPdu)); break;
          case dPdv:
-            mSgVarV = &(sg->dPdv); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, dPdv)); break;
          case dNdx:
-            mSgVarV = &(sg->dNdx); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, dNdx)); break;
          case dNdy:
-            mSgVarV = &(sg->dNdy); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, dNdy)); break;
          case dDdx:
-            mSgVarV = &(sg->dDdx); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, dDdx)); break;
          case dDdy:
-            mSgVarV = &(sg->dDdy); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, dDdy)); break;
          case Ld:
-            mSgVarV = &(sg->Ld); break;
+            setBinding(s_vector, offsetof(AtShaderGlobals, Ld)); break;
          case Li:
-            mSgVarC = &(sg->Li); break;
+            setBinding(s_color, offsetof(AtShaderGlobals, Li)); break;
          case Liu:
-            mSgVarC = &(sg->Liu); break;
+            setBinding(s_color, offsetof(AtShaderGlobals, Liu)); break;
          case Lo:
-            mSgVarC = &(sg->Lo); break;
+            setBinding(s_color, offsetof(AtShaderGlobals, Lo)); break;
          case Ci:
-            mSgVarC = &(sg->Ci); break;
+            setBinding(s_color, offsetof(AtShaderGlobals, Ci)); break;
          case Vo:
-            mSgVarC = &(sg->Vo); break;
+            setBinding(s_color, offsetof(AtShaderGlobals, Vo)); break;
          case u:
-            mSgVarF = &(sg->u); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, u)); break;
          case v:
-            mSgVarF = &(sg->v); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, v)); break;
          case bu:
-            mSgVarF = &(sg->bu); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, bu)); break;
          case bv:
-            mSgVarF = &(sg->bv); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, bv)); break;
          case x:
-            mSgVarI = &(sg->x); break;
+            setBinding(s_int, offsetof(AtShaderGlobals, x)); break;
          case y:
-            mSgVarI = &(sg->y); break;
+            setBinding(s_int, offsetof(AtShaderGlobals, y)); break;
          case sx:
-            mSgVarF = &(sg->sx); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, sx)); break;
          case sy:
-            mSgVarF = &(sg->sy); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, sy)); break;
          case we:
-            mSgVarF = &(sg->we); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, we)); break;
          case Rl:
-            mSgVarD = &(sg->Rl); break;
+            setBinding(s_double, offsetof(AtShaderGlobals, Rl)); break;
          case dudx:
-            mSgVarF = &(sg->dudx); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, dudx)); break;
          case dudy:
-            mSgVarF = &(sg->dudy); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, dudy)); break;
          case dvdx:
-            mSgVarF = &(sg->dvdx); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, dvdx)); break;
          case dvdy:
-            mSgVarF = &(sg->dvdy); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, dvdy)); break;
          case time:
-            mSgVarF = &(sg->time); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, time)); break;
          case area:
-            mSgVarF = &(sg->area); break;
-         case frame:
-            mSgVarF = &mFrame; break;
+            setBinding(s_float, offsetof(AtShaderGlobals, area)); break;
          case sample_frame:
-            mTime = &(sg->time);
-            mSgVarF = &mSampleFrame;
-            break;
-         case fps:
-            mSgVarF = &mFPS; break;
-         case shutter_open_time:
-            mSgVarF = &mShutterOpenTime; break;
-         case shutter_close_time:
-            mSgVarF = &mShutterCloseTime; break;
-         case shutter_open_frame:
-            mSgVarF = &mShutterOpenFrame; break;
-         case shutter_close_frame:
-            mSgVarF = &mShutterCloseFrame; break;
+            setBinding(s_sample_frame, offsetof(AtShaderGlobals, time)); break;
          case Ldist:
-            mSgVarF = &(sg->Ldist); break;
+            setBinding(s_float, offsetof(AtShaderGlobals, Ldist)); break;
          case sc:
-            mSgVarB = &(sg->sc); break;
+            setBinding(s_byte, offsetof(AtShaderGlobals, sc)); break;
          case Rt:
-            mSgVarU16 = &(sg->Rt); break;
+            setBinding(s_uint16, offsetof(AtShaderGlobals, Rt)); break;
          case Rr:
-            mSgVarB = &(sg->Rr); break;
+            setBinding(s_byte, offsetof(AtShaderGlobals, Rr)); break;
          case Rr_refl:
-            mSgVarB = &(sg->Rr_refl); break;
+            setBinding(s_byte, offsetof(AtShaderGlobals, Rr_refl)); break;
          case Rr_refr:
-            mSgVarB = &(sg->Rr_refr); break;
+            setBinding(s_byte, offsetof(AtShaderGlobals, Rr_refr)); break;
          case Rr_diff:
-            mSgVarB = &(sg->Rr_diff); break;
+            setBinding(s_byte, offsetof(AtShaderGlobals, Rr_diff)); break;
          case Rr_gloss:
-            mSgVarB = &(sg->Rr_gloss); break;
+            setBinding(s_byte, offsetof(AtShaderGlobals, Rr_gloss)); break;
          default:
-            AiMsgWarning("[seexpr] Unsupported shader globals \"%s\" (Default to 0)", EnumToName(mWhich));
             break;
          }
       }
-
-      return (mSgVarV != 0 || mSgVarF != 0 || mSgVarI != 0 || mSgVarD != 0);
    }
 
    inline int which() const
@@ -739,6 +1173,28 @@ public:
       return mWhich;
    }
 
+   inline int dim() const
+   {
+      return (mIsVec ? 3 : 1);
+   }
+
+   // VarBlock variable and offset in per-thread shader globals values
+   inline void setStorage(int index, int offset)
+   {
+      mIndex = index;
+      mValueOffset = offset;
+   }
+
+   inline int index() const
+   {
+      return mIndex;
+   }
+
+   inline int valueOffset() const
+   {
+      return mValueOffset;
+   }
+
    inline const char* name() const
    {
       return EnumToName(mWhich);
@@ -746,28 +1202,224 @@ public:
 
 protected:
    
+   enum Storage
+   {
+      s_none = 0,
+      s_vector,
+      s_color,
+      s_float,
+      s_int,
+      s_double,
+      s_byte,
+      s_uint16,
+      s_sample_frame
+   };
+   
+   inline void setBinding(Storage storage, size_t offset)
+   {
+      mStorage = storage;
+      mOffset = offset;
+   }
+   
    int mWhich;
    bool mIsVec;
-   float *mSgVarF;
-   AtVector *mSgVarV;
-   int *mSgVarI;
-   double *mSgVarD;
-   AtByte *mSgVarB;
-   AtColor *mSgVarC;
-   AtUInt16 *mSgVarU16;
-   float mFrame;
-   float mFPS;
-   float mMotionStart;
-   float mMotionEnd;
-   float mSampleFrame;
-   float *mTime;
-   float mShutterOpenTime;
-   float mShutterCloseTime;
-   float mShutterOpenFrame;
-   float mShutterCloseFrame;
+   Storage mStorage;
+   size_t mOffset; // in AtShaderGlobals
+   int mIndex;
+   int mValueOffset;
 };
 
 
+static bool GetNodeConstantFloat(AtNode *node, AtString name, float &val, const char *msg=NULL)
+{
+   const AtUserParamEntry *pe = AiNodeLookUpUserParameter(node, name);
+   if (pe != 0)
+   {
+      int type = AiUserParamGetType(pe);
+      int cat = AiUserParamGetCategory(pe);
+
+      if (cat == AI_USERDEF_CONSTANT)
+      {
+         switch (type)
+         {
+         case AI_TYPE_BYTE:
+            val = float(AiNodeGetByte(node, name));
+            break;
+         case AI_TYPE_INT:
+            val = float(AiNodeGetInt(node, name));
+            break;
+         case AI_TYPE_UINT:
+            val = float(AiNodeGetUInt(node, name));
+            break;
+         case AI_TYPE_FLOAT:
+            val = AiNodeGetFlt(node, name);
+            break;
+         default:
+            AiMsgWarning("[seexpr] \"%s\" parameter on node \"%s\" should be a float or an integer (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
+            return false;
+         }
+         return true;
+      }
+      else
+      {
+         AiMsgWarning("[seexpr] \"%s\" parameter on node \"%s\" must be a constant (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
+         return false;
+      }
+   }
+   else
+   {
+      AiMsgWarning("[seexpr] \"%s\" parameter not defined on node \"%s\" (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
+      return false;
+   }
+}
+
+static bool GetNodeConstantBool(AtNode *node, AtString name, bool &val, const char *msg=NULL)
+{
+   const AtUserParamEntry *pe = AiNodeLookUpUserParameter(node, name);
+   if (pe != 0)
+   {
+      int type = AiUserParamGetType(pe);
+      int cat = AiUserParamGetCategory(pe);
+
+      if (cat == AI_USERDEF_CONSTANT)
+      {
+         switch (type)
+         {
+         case AI_TYPE_BOOLEAN:
+            val = AiNodeGetBool(node, name);
+            break;
+         case AI_TYPE_BYTE:
+            val = (AiNodeGetByte(node, name) != 0);
+            break;
+         case AI_TYPE_INT:
+            val = (AiNodeGetInt(node, name) != 0);
+            break;
+         case AI_TYPE_UINT:
+            val = (AiNodeGetUInt(node, name) != 0);
+            break;
+         case AI_TYPE_FLOAT:
+            val = (AiNodeGetFlt(node, name) != 0.0f);
+            break;
+         default:
+            AiMsgWarning("[seexpr] \"%s\" parameter on node \"%s\" should be a boolean, an integer or a float (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
+            return false;
+         }
+         return true;
+      }
+      else
+      {
+         AiMsgWarning("[seexpr] \"%s\" parameter on node \"%s\" must be a constant (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
+         return false;
+      }
+   }
+   else
+   {
+      AiMsgWarning("[seexpr] \"%s\" parameter not defined on node \"%s\" (%s)", name.c_str(), AiNodeGetName(node), (msg ? msg : ""));
+      return false;
+   }
+}
+
+void RenderConstants::read(unsigned long long mask)
+{
+   AtNode *opts = AiUniverseGetOptions();
+
+   frame = 0.0f;
+   fps = 24.0f;
+   motionStart = 0.0f;
+   motionEnd = 0.0f;
+   shutterOpenTime = 0.0f;
+   shutterCloseTime = 0.0f;
+   shutterOpenFrame = 0.0f;
+   shutterCloseFrame = 0.0f;
+
+   if (mask & (1ULL << ArnoldSgVar::fps))
+   {
+      GetNodeConstantFloat(opts, SSTR::fps, fps, "Defaults to 24");
+   }
+   if (mask & (1ULL << ArnoldSgVar::frame))
+   {
+      GetNodeConstantFloat(opts, SSTR::frame, frame, "Defaults to 0");
+   }
+   if (mask & ((1ULL << ArnoldSgVar::sample_frame) | (1ULL << ArnoldSgVar::shutter_open_frame) | (1ULL << ArnoldSgVar::shutter_close_frame)))
+   {
+      bool relative = false;
+      float frame = 0.0f;
+      if (GetNodeConstantBool(opts, SSTR::relative_motion_frame, relative, "Defaults to false") && relative)
+      {
+         GetNodeConstantFloat(opts, SSTR::frame, frame, "Defaults to 0");
+      }
+      if (!GetNodeConstantFloat(opts, SSTR::motion_start_frame, motionStart, "Defaults to 'frame'"))
+      {
+         if (relative)
+         {
+            // already have value in frame variable
+            motionStart = frame;
+         }
+         else
+         {
+            GetNodeConstantFloat(opts, SSTR::frame, motionStart, "Defaults to 0");
+         }
+      }
+      else
+      {
+         motionStart += frame;
+      }
+      if (!GetNodeConstantFloat(opts, SSTR::motion_end_frame, motionEnd, "Defaults to 'motion_start_frame'"))
+      {
+         motionEnd = motionStart;
+      }
+      else
+      {
+         motionEnd += frame;
+      }
+   }
+   if (mask & ((1ULL << ArnoldSgVar::shutter_open_time) | (1ULL << ArnoldSgVar::shutter_close_time) |
+               (1ULL << ArnoldSgVar::shutter_open_frame) | (1ULL << ArnoldSgVar::shutter_close_frame)))
+   {
+      // Note: needs motion range first
+      shutterOpenFrame = motionStart;
+      shutterCloseFrame = shutterOpenFrame;
+      
+      AtNode *cam = AiUniverseGetCamera();
+      
+      if (cam)
+      {
+         shutterOpenTime = AiNodeGetFlt(cam, SSTR::shutter_start);
+         shutterCloseTime = AiNodeGetFlt(cam, SSTR::shutter_end);
+         
+         float motionLength = motionEnd - motionStart;
+         
+         if (motionLength > 0.0f)
+         {
+            shutterOpenFrame = motionStart + shutterOpenTime * motionLength;
+            shutterCloseFrame = motionStart + shutterCloseTime * motionLength;
+         }
+      }
+   }
+}
+
+double RenderConstants::value(int which) const
+{
+   switch (which)
+   {
+   case ArnoldSgVar::frame:
+      return double(frame);
+   case ArnoldSgVar::fps:
+      return double(fps);
+   case ArnoldSgVar::shutter_open_time:
+      return double(shutterOpenTime);
+   case ArnoldSgVar::shutter_close_time:
+      return double(shutterCloseTime);
+   case ArnoldSgVar::shutter_open_frame:
+      return double(shutterOpenFrame);
+   case ArnoldSgVar::shutter_close_frame:
+      return double(shutterCloseFrame);
+   default:
+      return 0.0;
+   }
+}
+
+
 class ArnoldUserVar : public SeExpr2::ExprVarRef
 {
 public:
@@ -782,8 +1434,7 @@ public:
       : SeExpr2::ExprVarRef(SeExpr2::ExprType().Error().Varying())
       , mName(name.c_str())
       , mIsVec(false)
-      , mSg(0)
-      , mType(AI_TYPE_UNDEFINED)
+      , mSlot(0)
    {
       switch (type)
       {
@@ -805,95 +1456,82 @@ public:
    {
    }
 
-   void _updateType(AtParamValue *value=0)
+   int _updateType(AtShaderGlobals *sg, AtParamValue *value=0)
    {
+      int type = AI_TYPE_UNDEFINED;
+
       AtParamValue tmpVal;
       if (!value)
       {
          value = &tmpVal;
       }
 
-      if (AiUserGetRGBAFunc(mName, mSg, &(value->RGBA)))
+      if (AiUserGetRGBAFunc(mName, sg, &(value->RGBA)))
       {
-         mType = AI_TYPE_RGBA;
+         type = AI_TYPE_RGBA;
       }
-      else if (AiUserGetRGBFunc(mName, mSg, &(value->RGB)))
+      else if (AiUserGetRGBFunc(mName, sg, &(value->RGB)))
       {
-         mType = AI_TYPE_RGB;
+         type = AI_TYPE_RGB;
       }
-      else if (AiUserGetVecFunc(mName, mSg, &(value->VEC)))
+      else if (AiUserGetVecFunc(mName, sg, &(value->VEC)))
       {
-         mType = AI_TYPE_VECTOR;
+         type = AI_TYPE_VECTOR;
       }
-      else if (AiUserGetPntFunc(mName, mSg, &(value->PNT)))
+      else if (AiUserGetPntFunc(mName, sg, &(value->PNT)))
       {
-         mType = AI_TYPE_POINT;
+         type = AI_TYPE_POINT;
       }
-      else if (AiUserGetPnt2Func(mName, mSg, &(value->PNT2)))
+      else if (AiUserGetPnt2Func(mName, sg, &(value->PNT2)))
       {
-         mType = AI_TYPE_POINT2;
+         type = AI_TYPE_POINT2;
       }
-      else if (AiUserGetFltFunc(mName, mSg, &(value->FLT)))
+      else if (AiUserGetFltFunc(mName, sg, &(value->FLT)))
       {
-         mType = AI_TYPE_FLOAT;
+         type = AI_TYPE_FLOAT;
       }
-      else if (AiUserGetIntFunc(mName, mSg, &(value->INT)))
+      else if (AiUserGetIntFunc(mName, sg, &(value->INT)))
       {
-         mType = AI_TYPE_INT;
+         type = AI_TYPE_INT;
       }
-      else if (AiUserGetUIntFunc(mName, mSg, &(value->UINT)))
+      else if (AiUserGetUIntFunc(mName, sg, &(value->UINT)))
       {
-         mType = AI_TYPE_UINT;
+         type = AI_TYPE_UINT;
       }
-      else if (AiUserGetByteFunc(mName, mSg, &(value->BYTE)))
+      else if (AiUserGetByteFunc(mName, sg, &(value->BYTE)))
       {
-         mType = AI_TYPE_BYTE;
+         type = AI_TYPE_BYTE;
       }
-      else if (AiUserGetStrFunc(mName, mSg, &(value->STR)))
+      else if (AiUserGetStrFunc(mName, sg, &(value->STR)))
       {
-         mType = AI_TYPE_STRING;
-      }
-      else
-      {
-         mType = AI_TYPE_UNDEFINED;
+         type = AI_TYPE_STRING;
       }
+
+      return type;
    }
 
    virtual void eval(const char **result)
    {
-      if (mSg)
+      AtShaderGlobals *sg = gBindings->sg;
+
+      if (sg)
       {
-         bool queryVal = true;
          AtParamValue value;
+         int type = fetch(sg, value);
 
-         if (mType == AI_TYPE_UNDEFINED)
+         if (type == AI_TYPE_STRING)
          {
-            _updateType(&value);
-            queryVal = false;
+            result[0] = value.STR;
+            return;
          }
-
-         if (mType == AI_TYPE_STRING)
+         else if (type == AI_TYPE_UNDEFINED)
          {
-            if (queryVal)
-            {
-               if (!AiUserGetStrFunc(mName, mSg, &(value.STR)))
-               {
-                  AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-               }
-               else
-               {
-                  result[0] = value.STR;
-                  return;
-               }
-            }
-            else
-            {
-               result[0] = value.STR;
-               return;
-            }
+            AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
+         }
+         else
+         {
+            AiMsgWarning("[seexpr] Unsupported type for user variable \"%s\"", mName.c_str());
          }
-
-         AiMsgWarning("[seexpr] Unsupported type for user variable \"%s\"", mName.c_str());
       }
       else
       {
@@ -905,29 +1543,17 @@ public:
 
    virtual void eval(double *result)
    {
-      if (mSg)
+      AtShaderGlobals *sg = gBindings->sg;
+
+      if (sg)
       {
-         bool queryVal = true;
          AtParamValue value;
-         
-         if (mType == AI_TYPE_UNDEFINED)
-         {
-            _updateType(&value);
-            queryVal = false;
-         }
+         int type = fetch(sg, value);
 
-         switch (mType)
+         switch (type)
          {
          case AI_TYPE_BYTE:
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetByteFunc(mName, mSg, &(value.BYTE)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
                float v = float(value.BYTE);
                result[0] = v;
                if (mIsVec)
@@ -939,14 +1565,6 @@ public:
             }
          case AI_TYPE_INT:
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetIntFunc(mName, mSg, &(value.INT)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
                float v = float(value.INT);
                result[0] = v;
                if (mIsVec)
@@ -958,14 +1576,6 @@ public:
             }
          case AI_TYPE_UINT:
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetUIntFunc(mName, mSg, &(value.UINT)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
                float v = float(value.UINT);
                result[0] = v;
                if (mIsVec)
@@ -976,118 +1586,60 @@ public:
                return;
             }
          case AI_TYPE_FLOAT:
+            result[0] = value.FLT;
+            if (mIsVec)
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetFltFunc(mName, mSg, &(value.FLT)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
-               result[0] = value.FLT;
-               if (mIsVec)
-               {
-                  result[1] = value.FLT;
-                  result[2] = value.FLT;
-               }
-               return;
+               result[1] = value.FLT;
+               result[2] = value.FLT;
             }
+            return;
          case AI_TYPE_POINT2:
+            result[0] = value.PNT2.x;
+            if (mIsVec)
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetPnt2Func(mName, mSg, &(value.PNT2)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
-               result[0] = value.PNT2.x;
-               if (mIsVec)
-               {
-                  result[1] = value.PNT2.y;
-                  result[2] = 0.0;
-               }
-               return;
+               result[1] = value.PNT2.y;
+               result[2] = 0.0;
             }
+            return;
          case AI_TYPE_POINT:
+            result[0] = value.PNT.x;
+            if (mIsVec)
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetPntFunc(mName, mSg, &(value.PNT)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
-               result[0] = value.PNT.x;
-               if (mIsVec)
-               {
-                  result[1] = value.PNT.y;
-                  result[2] = value.PNT.z;
-               }
-               return;
+               result[1] = value.PNT.y;
+               result[2] = value.PNT.z;
             }
+            return;
          case AI_TYPE_VECTOR:
+            result[0] = value.VEC.x;
+            if (mIsVec)
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetVecFunc(mName, mSg, &(value.VEC)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
-               result[0] = value.VEC.x;
-               if (mIsVec)
-               {
-                  result[1] = value.VEC.y;
-                  result[2] = value.VEC.z;
-               }
-               return;
+               result[1] = value.VEC.y;
+               result[2] = value.VEC.z;
             }
+            return;
          case AI_TYPE_RGB:
+            result[0] = value.RGB.r;
+            if (mIsVec)
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetRGBFunc(mName, mSg, &(value.RGB)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
-               result[0] = value.RGB.r;
-               if (mIsVec)
-               {
-                  result[1] = value.RGB.g;
-                  result[2] = value.RGB.b;
-               }
-               return;
+               result[1] = value.RGB.g;
+               result[2] = value.RGB.b;
             }
+            return;
          case AI_TYPE_RGBA:
+            result[0] = value.RGBA.r;
+            if (mIsVec)
             {
-               if (queryVal)
-               {
-                  if (!AiUserGetRGBAFunc(mName, mSg, &(value.RGBA)))
-                  {
-                     AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
-                     break;
-                  }
-               }
-               result[0] = value.RGBA.r;
-               if (mIsVec)
-               {
-                  result[1] = value.RGBA.g;
-                  result[2] = value.RGBA.b;
-               }
-               return;
+               result[1] = value.RGBA.g;
+               result[2] = value.RGBA.b;
             }
+            return;
+         case AI_TYPE_UNDEFINED:
+            AiMsgWarning("[seexpr] Failed to retrieve user variable \"%s\"", mName.c_str());
+            break;
          default:
+            AiMsgWarning("[seexpr] Unsupported type for user variable \"%s\"", mName.c_str());
             break;
          }
-
-         AiMsgWarning("[seexpr] Unsupported type for user variable \"%s\"", mName.c_str());
       }
       else
       {
@@ -1102,11 +1654,61 @@ public:
       }
    }
 
-   bool bind(AtNode *, AtShaderGlobals *sg)
+   // Reads the value with the type last resolved for the shape (thread
+   //   bindings then node cache), all types are probed again and the cache
+   //   overwritten when unknown or when the typed query fails
+   int fetch(AtShaderGlobals *sg, AtParamValue &value)
    {
-      mSg = sg;
-      mType = AI_TYPE_UNDEFINED;
-      return true;
+      int &type = gBindings->userTypes[mSlot];
+      const AtNode *&shape = gBindings->userShapes[mSlot];
+      ShapeTypeCache *cache = gBindings->shapeTypes;
+
+      if (shape != sg->Op)
+      {
+         shape = sg->Op;
+         type = (cache ? cache->get(shape, mSlot) : int(AI_TYPE_UNDEFINED));
+      }
+
+      if (type == AI_TYPE_UNDEFINED || !_getValue(type, sg, value))
+      {
+         int prevType = type;
+         type = _updateType(sg, &value);
+         if (cache && type != prevType)
+         {
+            cache->set(shape, mSlot, type);
+         }
+      }
+
+      return type;
+   }
+
+   bool _getValue(int type, AtShaderGlobals *sg, AtParamValue &value) const
+   {
+      switch (type)
+      {
+      case AI_TYPE_BYTE:
+         return AiUserGetByteFunc(mName, sg, &(value.BYTE));
+      case AI_TYPE_INT:
+         return AiUserGetIntFunc(mName, sg, &(value.INT));
+      case AI_TYPE_UINT:
+         return AiUserGetUIntFunc(mName, sg, &(value.UINT));
+      case AI_TYPE_FLOAT:
+         return AiUserGetFltFunc(mName, sg, &(value.FLT));
+      case AI_TYPE_POINT2:
+         return AiUserGetPnt2Func(mName, sg, &(value.PNT2));
+      case AI_TYPE_POINT:
+         return AiUserGetPntFunc(mName, sg, &(value.PNT));
+      case AI_TYPE_VECTOR:
+         return AiUserGetVecFunc(mName, sg, &(value.VEC));
+      case AI_TYPE_RGB:
+         return AiUserGetRGBFunc(mName, sg, &(value.RGB));
+      case AI_TYPE_RGBA:
+         return AiUserGetRGBAFunc(mName, sg, &(value.RGBA));
+      case AI_TYPE_STRING:
+         return AiUserGetStrFunc(mName, sg, &(value.STR));
+      default:
+         return false;
+      }
    }
 
    inline const char* name() const
@@ -1114,24 +1716,29 @@ public:
       return mName.c_str();
    }
 
+   inline void setSlot(size_t slot)
+   {
+      mSlot = slot;
+   }
+
 protected:
 
    AtString mName;
    bool mIsVec;
-   AtShaderGlobals *mSg;
-   int mType;
+   size_t mSlot;
 };
 
 
 class ArnoldShaderVar : public SeExpr2::ExprVarRef
 {
 public:
-   ArnoldShaderVar(const std::string &name, bool isVec=false)
+   // Note: only used for linked parameters, others are stored in VarBlock
+   ArnoldShaderVar(const std::string &name, unsigned int var, unsigned int index, bool isVec=false)
       : SeExpr2::ExprVarRef(SeExpr2::ExprType().FP(isVec ? 3 : 1).Varying())
       , mName(name)
       , mIsVec(isVec)
-      , mIndex(0)
-      , mValues(0)
+      , mVar(var)
+      , mIndex(index)
    {
    }
 
@@ -1146,18 +1753,52 @@ public:
 
    virtual void eval(double *result)
    {
-      if (mValues && mIndex < mValues->nelements)
+      ArnoldBindings &b = *gBindings;
+      
+      if (b.links && b.links[mVar].linked)
+      {
+         // Upstream shaders are only evaluated when the variable is actually read
+         double *values = &(b.linkValues[3 * mVar]);
+         if (b.linkStamps[mVar] != b.sample)
+         {
+            evalLink(b, values);
+            b.linkStamps[mVar] = b.sample;
+         }
+         result[0] = values[0];
+         if (mIsVec)
+         {
+            result[1] = values[1];
+            result[2] = values[2];
+         }
+         return;
+      }
+      
+      evalValue(b, result);
+   }
+
+   inline const char* name() const
+   {
+      return mName.c_str();
+   }
+
+protected:
+
+   void evalValue(const ArnoldBindings &b, double *result) const
+   {
+      AtArray *values = (mIsVec ? b.vvalues : b.fvalues);
+      
+      if (values && mIndex < values->nelements)
       {
          if (mIsVec)
          {
-            AtVector v = AiArrayGetVec(mValues, mIndex);
+            AtVector v = AiArrayGetVec(values, mIndex);
             result[0] = v.x;
             result[1] = v.y;
             result[2] = v.z;
          }
          else
          {
-            float v = AiArrayGetFlt(mValues, mIndex);
+            float v = AiArrayGetFlt(values, mIndex);
             result[0] = v;
          }
       }
@@ -1172,252 +1813,2376 @@ public:
       }
    }
 
-   bool bind(AtNode *node, AtShaderGlobals *)
+   void evalLink(const ArnoldBindings &b, double *result) const
    {
-      SeExprData *data = (SeExprData*) AiNodeGetLocalData(node);
-      if (data)
+      const ParamLink &link = b.links[mVar];
+      double out[4];
+      
+      if (link.whole)
       {
-         std::map<std::string, unsigned int>::iterator it = data->varindex.find(mName);
-         if (it != data->varindex.end())
+         // whole element link
+         EvalUpstream(b.sg, link.node[0], link.type[0], out);
+         result[0] = out[0];
+         result[1] = out[1];
+         result[2] = out[2];
+         if (link.comp[0] >= 0)
          {
-            if (it->second >= data->numfvars)
-            {
-               mIndex = it->second - data->numfvars;
-            }
-            else
+            result[0] = out[link.comp[0]];
+            result[1] = result[0];
+            result[2] = result[0];
+         }
+      }
+      else
+      {
+         evalValue(b, result);
+         for (int i=0; i<3; ++i)
+         {
+            if (link.node[i])
             {
-               mIndex = it->second;
+               EvalUpstream(b.sg, link.node[i], link.type[i], out);
+               result[i] = out[link.comp[i] >= 0 ? link.comp[i] : i];
             }
-            return true;
          }
       }
-      return false;
    }
 
-   void bindShaderParams(AtArray *fvalues, AtArray *vvalues)
+   // sg->out belongs to the shader being evaluated, it is restored once the
+   //   upstream result has been read
+   static void EvalUpstream(AtShaderGlobals *sg, AtNode *node, int type, double *result)
+   {
+      decltype(sg->out) out = sg->out;
+      
+      AiShaderEvaluate(node, sg);
+      
+      result[3] = 1.0;
+      
+      switch (type)
+      {
+      case AI_TYPE_FLOAT:
+         result[0] = result[1] = result[2] = sg->out.FLT;
+         break;
+      case AI_TYPE_INT:
+      case AI_TYPE_ENUM:
+         result[0] = result[1] = result[2] = double(sg->out.INT);
+         break;
+      case AI_TYPE_UINT:
+         result[0] = result[1] = result[2] = double(sg->out.UINT);
+         break;
+      case AI_TYPE_BYTE:
+         result[0] = result[1] = result[2] = double(sg->out.BYTE);
+         break;
+      case AI_TYPE_BOOLEAN:
+         result[0] = result[1] = result[2] = (sg->out.BOOL ? 1.0 : 0.0);
+         break;
+      case AI_TYPE_RGB:
+         result[0] = sg->out.RGB.r;
+         result[1] = sg->out.RGB.g;
+         result[2] = sg->out.RGB.b;
+         break;
+      case AI_TYPE_RGBA:
+         result[0] = sg->out.RGBA.r;
+         result[1] = sg->out.RGBA.g;
+         result[2] = sg->out.RGBA.b;
+         result[3] = sg->out.RGBA.a;
+         break;
+      case AI_TYPE_VECTOR:
+      case AI_TYPE_POINT:
+         result[0] = sg->out.VEC.x;
+         result[1] = sg->out.VEC.y;
+         result[2] = sg->out.VEC.z;
+         break;
+      case AI_TYPE_POINT2:
+         result[0] = sg->out.PNT2.x;
+         result[1] = sg->out.PNT2.y;
+         result[2] = 0.0;
+         break;
+      default:
+         result[0] = result[1] = result[2] = 0.0;
+         break;
+      }
+      
+      sg->out = out;
+   }
+
+   std::string mName;
+   bool mIsVec;
+   unsigned int mVar; // index in fvars then vvars
+   unsigned int mIndex; // index in fvars or vvars
+};
+
+
+// Native functions implemented against the Arnold API (see ArnoldExpr::resolveFunc)
+//   Functions reading the shading context return varying values so that they
+//   are neither folded nor evaluated outside of shader_evaluate
+class ArnoldFunc : public SeExpr2::ExprFuncSimple
+{
+public:
+   ArnoldFunc()
+      : SeExpr2::ExprFuncSimple(true)
    {
-      mValues = (mIsVec ? vvalues : fvalues);
    }
 
-   inline const char* name() const
+   virtual ~ArnoldFunc()
    {
-      return mName.c_str();
+   }
+
+   virtual SeExpr2::ExprFuncNode::Data* evalConstant(const SeExpr2::ExprFuncNode*, ArgHandle&) const
+   {
+      return new SeExpr2::ExprFuncNode::Data();
    }
 
 protected:
 
-   std::string mName;
-   bool mIsVec;
-   unsigned int mIndex;
-   AtArray *mValues;
-};
+   // Return type with the least constant lifetime of the arguments
+   static SeExpr2::ExprType ArgsLifetime(const SeExpr2::ExprFuncNode *node, int dim)
+   {
+      SeExpr2::ExprType type = SeExpr2::ExprType().FP(dim).Constant();
+      for (int i=0; i<node->numChildren(); ++i)
+      {
+         type.setLifetime(type, node->child(i)->type());
+      }
+      return type;
+   }
 
+   static AtShaderGlobals* ShaderGlobals()
+   {
+      return (gBindings ? gBindings->sg : 0);
+   }
 
-class ArnoldExpr : public SeExpr2::Expression
+   static void SetOutput(ArgHandle &args, const AtColor &c)
+   {
+      double *out = &(args.outFp);
+      out[0] = c.r;
+      out[1] = c.g;
+      out[2] = c.b;
+   }
+};
+
+// noise3(P[, octaves[, distortion[, lacunarity]]])
+class ArnoldNoise3Func : public ArnoldFunc
 {
 public:
-   
-   ArnoldExpr()
-      : SeExpr2::Expression()
-      , mBound(false)
-      , mBoundSg(0)
-      , mNode(0)
+   virtual SeExpr2::ExprType prep(SeExpr2::ExprFuncNode *node, bool, SeExpr2::ExprVarEnvBuilder &envBuilder) const
    {
+      bool valid = node->checkArg(0, SeExpr2::ExprType().FP(3).Varying(), envBuilder);
+      for (int i=1; i<node->numChildren(); ++i)
+      {
+         valid &= node->checkArg(i, SeExpr2::ExprType().FP(1).Varying(), envBuilder);
+      }
+      return (valid ? ArgsLifetime(node, 1) : SeExpr2::ExprType().Error());
    }
-   
-   ArnoldExpr(AtNode *n, const std::string &e)
-      : SeExpr2::Expression(e)
-      , mBound(false)
-      , mBoundSg(0)
-      , mNode(n)
+
+   virtual void eval(ArgHandle args)
    {
+      SeExpr2::Vec<double, 3, true> P = args.inFp<3>(0);
+      AtPoint p = {float(P[0]), float(P[1]), float(P[2])};
+      int octaves = (args.nargs() > 1 ? int(args.inFp<1>(1)[0]) : 1);
+      float distortion = (args.nargs() > 2 ? float(args.inFp<1>(2)[0]) : 0.0f);
+      float lacunarity = (args.nargs() > 3 ? float(args.inFp<1>(3)[0]) : 1.92f);
+      args.outFp = AiNoise3(p, octaves, distortion, lacunarity);
+   }
+};
 
-      // should all all sg vars here to avoid runtime access
+// cellnoise3(P)
+class ArnoldCellNoise3Func : public ArnoldFunc
+{
+public:
+   virtual SeExpr2::ExprType prep(SeExpr2::ExprFuncNode *node, bool, SeExpr2::ExprVarEnvBuilder &envBuilder) const
+   {
+      bool valid = node->checkArg(0, SeExpr2::ExprType().FP(3).Varying(), envBuilder);
+      return (valid ? ArgsLifetime(node, 1) : SeExpr2::ExprType().Error());
    }
 
-   ArnoldExpr(AtNode *n, AtString e)
-      : SeExpr2::Expression(e.c_str())
-      , mBound(false)
-      , mBoundSg(0)
-      , mNode(n)
+   virtual void eval(ArgHandle args)
    {
+      SeExpr2::Vec<double, 3, true> P = args.inFp<3>(0);
+      AtPoint p = {float(P[0]), float(P[1]), float(P[2])};
+      args.outFp = AiCellNoise3(p);
    }
-   
-   virtual ~ArnoldExpr()
+};
+
+// trace_occlusion(mint, maxt[, spread[, N]])
+//   Occlusion at the shading point, around the forward facing normal by default
+class ArnoldOcclusionFunc : public ArnoldFunc
+{
+public:
+   virtual SeExpr2::ExprType prep(SeExpr2::ExprFuncNode *node, bool, SeExpr2::ExprVarEnvBuilder &envBuilder) const
    {
-      clearExternals();
+      bool valid = node->checkArg(0, SeExpr2::ExprType().FP(1).Varying(), envBuilder);
+      valid &= node->checkArg(1, SeExpr2::ExprType().FP(1).Varying(), envBuilder);
+      if (node->numChildren() > 2)
+      {
+         valid &= node->checkArg(2, SeExpr2::ExprType().FP(1).Varying(), envBuilder);
+      }
+      if (node->numChildren() > 3)
+      {
+         valid &= node->checkArg(3, SeExpr2::ExprType().FP(3).Varying(), envBuilder);
+      }
+      return (valid ? SeExpr2::ExprType().FP(3).Varying() : SeExpr2::ExprType().Error());
    }
-   
-   virtual SeExpr2::ExprVarRef* resolveVar(const std::string& name) const
+
+   virtual void eval(ArgHandle args)
    {
-      if (name.length() >= 4 && !strncmp(name.c_str(), "sg::", 4))
+      AtShaderGlobals *sg = ShaderGlobals();
+      if (!sg)
       {
-         // -> found sg var
-         std::string sgname = name.substr(4);
-         ArnoldSgVar *var = new ArnoldSgVar(sgname);
-         if (var->which() == ArnoldSgVar::undefined)
-         {
-            AiMsgWarning("[seexpr] Unsupported shader globals \"%s\"", sgname.c_str());
-            return 0;
-         }
-         else
-         {
-            mSgVars.push_back(var);
-            return var;
-         }
+         SetOutput(args, AI_RGB_BLACK);
+         return;
       }
-      else if (name.length() >= 6 && !strncmp(name.c_str(), "user::", 6))
+      float mint = float(args.inFp<1>(0)[0]);
+      float maxt = float(args.inFp<1>(1)[0]);
+      float spread = (args.nargs() > 2 ? float(args.inFp<1>(2)[0]) : 1.0f);
+      AtVector N = sg->Nf;
+      if (args.nargs() > 3)
       {
-         // without any further specification, use broad vector type
-         std::string uname = name.substr(6);
-         ArnoldUserVar *var = new ArnoldUserVar(uname, ArnoldUserVar::Vector);
-         mUserVars.push_back(var);
-         return var;
+         SeExpr2::Vec<double, 3, true> n = args.inFp<3>(3);
+         N.x = float(n[0]);
+         N.y = float(n[1]);
+         N.z = float(n[2]);
       }
-      else if (name.length() >= 8 && !strncmp(name.c_str(), "user_", 5))
+      AtVector Nbent;
+      SetOutput(args, AiOcclusion(&N, &(sg->Ngf), sg, mint, maxt, spread, &Nbent));
+   }
+};
+
+// texture(path[, u, v[, dudx, dudy, dvdx, dvdy]])
+//   Lookup at the shading point uv coordinates by default. The shading point
+//   derivatives select the mip level unless explicitly given
+class ArnoldTextureFunc : public ArnoldFunc
+{
+public:
+   // Constant path texture handle slot (see ArnoldExpr::texturePaths)
+   struct Data : public SeExpr2::ExprFuncNode::Data
+   {
+      int slot;
+   };
+
+   virtual SeExpr2::ExprType prep(SeExpr2::ExprFuncNode *node, bool, SeExpr2::ExprVarEnvBuilder &envBuilder) const
+   {
+      int nargs = node->numChildren();
+      bool valid = node->checkArg(0, SeExpr2::ExprType().String().Varying(), envBuilder);
+      if (nargs == 3 || nargs == 7)
       {
-         // new type specific prefices for user attributes
-         //   user_v:: -> Float[3]
-         //   user_f:: -> Float
-         //   user_s:: -> String
-         if (!strncmp(name.c_str() + 5, "f::", 3))
-         {
-            std::string uname = name.substr(8);
-            ArnoldUserVar *var = new ArnoldUserVar(uname, ArnoldUserVar::Float);
-            mUserVars.push_back(var);
-            return var;
-         }
-         else if (!strncmp(name.c_str() + 5, "v::", 3))
+         for (int i=1; i<nargs; ++i)
          {
-            std::string uname = name.substr(8);
-            ArnoldUserVar *var = new ArnoldUserVar(uname, ArnoldUserVar::Vector);
-            mUserVars.push_back(var);
-            return var;
+            valid &= node->checkArg(i, SeExpr2::ExprType().FP(1).Varying(), envBuilder);
          }
-         else if (!strncmp(name.c_str() + 5, "s::", 3))
+      }
+      else if (nargs != 1)
+      {
+         valid = false;
+      }
+      if (valid)
+      {
+         RegisterPath(node);
+      }
+      return (valid ? SeExpr2::ExprType().FP(3).Varying() : SeExpr2::ExprType().Error());
+   }
+
+   virtual SeExpr2::ExprFuncNode::Data* evalConstant(const SeExpr2::ExprFuncNode *node, ArgHandle &args) const;
+
+private:
+
+   // Constant paths must be known before evalConstant looks their slot up,
+   //   which happens as soon as prep succeeds (still in ArnoldExpr::compile)
+   static void RegisterPath(const SeExpr2::ExprFuncNode *node);
+
+   // Restores the shading point coordinates overridden for a lookup, at the
+   //   latest when leaving eval
+   class TextureCoordsOverride
+   {
+   public:
+      TextureCoordsOverride(AtShaderGlobals *sg)
+         : mSg(sg), mU(sg->u), mV(sg->v)
+         , mDudx(sg->dudx), mDudy(sg->dudy), mDvdx(sg->dvdx), mDvdy(sg->dvdy)
+      {
+      }
+
+      ~TextureCoordsOverride()
+      {
+         restore();
+      }
+
+      void restore()
+      {
+         if (mSg)
          {
-            std::string uname = name.substr(8);
-            ArnoldUserVar *var = new ArnoldUserVar(uname, ArnoldUserVar::String);
-            mUserVars.push_back(var);
-            return var;
+            mSg->u = mU;
+            mSg->v = mV;
+            mSg->dudx = mDudx;
+            mSg->dudy = mDudy;
+            mSg->dvdx = mDvdx;
+            mSg->dvdy = mDvdy;
+            mSg = 0;
          }
       }
 
-      SeExprData *data = (SeExprData*) (mNode ? AiNodeGetLocalData(mNode) : 0);
-      
-      // Note: this code is only called for used variables!
-      std::map<std::string, unsigned int>::const_iterator varit = data->varindex.find(name);
-      if (varit != data->varindex.end())
+   private:
+      AtShaderGlobals *mSg;
+      float mU, mV, mDudx, mDudy, mDvdx, mDvdy;
+   };
+
+public:
+
+   virtual void eval(ArgHandle args)
+   {
+      AtShaderGlobals *sg = ShaderGlobals();
+      int slot = static_cast<const Data*>(args.data)->slot;
+      AtTextureHandle *handle = (slot >= 0 && gBindings && gBindings->textures ? gBindings->textures[slot] : 0);
+      const char *path = (handle ? 0 : args.inStr(0));
+      if (!sg || (!handle && !path))
+      {
+         SetOutput(args, AI_RGB_BLACK);
+         return;
+      }
+      // Arnold 4 texture lookups read coordinates from the shader globals only
+      TextureCoordsOverride coords(sg);
+      if (args.nargs() >= 3)
+      {
+         sg->u = float(args.inFp<1>(1)[0]);
+         sg->v = float(args.inFp<1>(2)[0]);
+      }
+      if (args.nargs() == 7)
+      {
+         sg->dudx = float(args.inFp<1>(3)[0]);
+         sg->dudy = float(args.inFp<1>(4)[0]);
+         sg->dvdx = float(args.inFp<1>(5)[0]);
+         sg->dvdy = float(args.inFp<1>(6)[0]);
+      }
+      AtTextureParams params;
+      AiTextureParamsSetDefaults(&params);
+      bool success = false;
+      AtRGBA c = (handle ? AiTextureHandleAccess(sg, handle, &params, &success) : AiTextureAccess(sg, path, &params, &success));
+      coords.restore();
+      if (!success)
+      {
+         SetOutput(args, AI_RGB_BLACK);
+         return;
+      }
+      AtColor rgb = {c.r, c.g, c.b};
+      SetOutput(args, rgb);
+   }
+};
+
+// fbm(P[, octaves[, lacunarity[, gain]]]) and turbulence(...)
+//   Replace SeExpr's built-ins (same defaults and results, see noise.h),
+//   arguments are vectors as for the built-ins, only their first component
+//   is used past P
+class ArnoldFbmFunc : public ArnoldFunc
+{
+public:
+   ArnoldFbmFunc(bool turbulence)
+      : mTurbulence(turbulence)
+   {
+   }
+
+   virtual SeExpr2::ExprType prep(SeExpr2::ExprFuncNode *node, bool, SeExpr2::ExprVarEnvBuilder &envBuilder) const
+   {
+      bool valid = true;
+      for (int i=0; i<node->numChildren(); ++i)
+      {
+         valid &= node->checkArg(i, SeExpr2::ExprType().FP(3).Varying(), envBuilder);
+      }
+      return (valid ? ArgsLifetime(node, 1) : SeExpr2::ExprType().Error());
+   }
+
+   virtual void eval(ArgHandle args)
+   {
+      SeExpr2::Vec<double, 3, true> P = args.inFp<3>(0);
+      double p[3] = {P[0], P[1], P[2]};
+      int octaves = (args.nargs() > 1 ? int(args.inFp<3>(1)[0]) : 6);
+      double lacunarity = (args.nargs() > 2 ? args.inFp<3>(2)[0] : 2.0);
+      double gain = (args.nargs() > 3 ? args.inFp<3>(3)[0] : 0.5);
+      args.outFp = (mTurbulence ? NoiseTurbulence(p, octaves, lacunarity, gain) : NoiseFbm(p, octaves, lacunarity, gain));
+   }
+
+private:
+
+   bool mTurbulence;
+};
+
+// voronoi(P[, type[, jitter[, fbmScale[, fbmOctaves[, fbmLacunarity[, fbmGain]]]]]])
+//   Replaces SeExpr's built-in (same defaults and results, see noise.h)
+class ArnoldVoronoiFunc : public ArnoldFunc
+{
+public:
+   virtual SeExpr2::ExprType prep(SeExpr2::ExprFuncNode *node, bool, SeExpr2::ExprVarEnvBuilder &envBuilder) const
+   {
+      bool valid = true;
+      for (int i=0; i<node->numChildren(); ++i)
+      {
+         valid &= node->checkArg(i, SeExpr2::ExprType().FP(3).Varying(), envBuilder);
+      }
+      return (valid ? ArgsLifetime(node, 3) : SeExpr2::ExprType().Error());
+   }
+
+   virtual void eval(ArgHandle args)
+   {
+      SeExpr2::Vec<double, 3, true> P = args.inFp<3>(0);
+      double p[3] = {P[0], P[1], P[2]};
+      int nargs = args.nargs();
+      int type = (nargs > 1 ? int(args.inFp<3>(1)[0]) : 1);
+      double jitter = (nargs > 2 ? std::max(1e-3, std::min(args.inFp<3>(2)[0], 1.0)) : 0.5);
+      double fbmScale = (nargs > 3 ? args.inFp<3>(3)[0] : 0.0);
+      int fbmOctaves = (nargs > 4 ? int(args.inFp<3>(4)[0]) : 4);
+      double fbmLacunarity = (nargs > 5 ? args.inFp<3>(5)[0] : 2.0);
+      double fbmGain = (nargs > 6 ? args.inFp<3>(6)[0] : 0.5);
+      NoiseVoronoi(p, type, jitter, fbmScale, fbmOctaves, fbmLacunarity, fbmGain, &(args.outFp));
+   }
+};
+
+// curve(param, pos0, val0, interp0, ...) and ccurve(...)
+//   Same as SeExpr's built-ins (constant control points) but the curve is
+//   sampled once in a dense table so that lookups don't search the curve
+//   segments. Curves with step interpolation are evaluated exactly, as are
+//   all curves when 'curve_resolution' is 0 (the default). spline() is left
+//   to SeExpr: its evenly spaced control points are indexed directly
+template <typename T>
+class ArnoldCurveFunc : public ArnoldFunc
+{
+public:
+   struct Data : public SeExpr2::ExprFuncNode::Data
+   {
+      SeExpr2::Curve<T> curve;
+      std::vector<T> table; // empty for exact evaluation
+      double start;
+      double scale; // table entries per parameter unit
+
+      void build(int resolution, double pmin, double pmax)
+      {
+         table.resize(resolution);
+         start = pmin;
+         scale = double(resolution - 1) / (pmax - pmin);
+         for (int i=0; i<resolution; ++i)
+         {
+            table[i] = curve.getValue(pmin + double(i) / scale);
+         }
+      }
+
+      inline T value(double param) const
+      {
+         if (table.empty())
+         {
+            return curve.getValue(param);
+         }
+         double x = (param - start) * scale;
+         if (!(x > 0.0))
+         {
+            return table.front();
+         }
+         if (x >= double(table.size() - 1))
+         {
+            return table.back();
+         }
+         size_t i = size_t(x);
+         double t = x - double(i);
+         return table[i] * (1.0 - t) + table[i+1] * t;
+      }
+   };
+
+   virtual SeExpr2::ExprType prep(SeExpr2::ExprFuncNode *node, bool, SeExpr2::ExprVarEnvBuilder &envBuilder) const
+   {
+      int nargs = node->numChildren();
+      if (nargs < 4 || (nargs - 1) % 3 != 0)
+      {
+         node->addError("Wrong number of arguments, should be 1 plus a multiple of 3");
+         return SeExpr2::ExprType().Error();
+      }
+      bool valid = node->checkArg(0, SeExpr2::ExprType().FP(1).Varying(), envBuilder);
+      for (int i=1; i<nargs; i+=3)
+      {
+         valid &= node->checkArg(i, SeExpr2::ExprType().FP(1).Constant(), envBuilder);
+         valid &= node->checkArg(i+1, SeExpr2::ExprType().FP(Dim()).Constant(), envBuilder);
+         valid &= node->checkArg(i+2, SeExpr2::ExprType().FP(1).Constant(), envBuilder);
+      }
+      return (valid ? ArgsLifetime(node, Dim()) : SeExpr2::ExprType().Error());
+   }
+
+   virtual SeExpr2::ExprFuncNode::Data* evalConstant(const SeExpr2::ExprFuncNode *node, ArgHandle &args) const;
+
+   virtual void eval(ArgHandle args)
+   {
+      const Data *data = static_cast<const Data*>(args.data);
+      Write(args, data->value(args.inFp<1>(0)[0]));
+   }
+
+private:
+
+   static inline int Dim()
+   {
+      return (std::is_same<T, double>::value ? 1 : 3);
+   }
+
+   static inline void Read(ArgHandle &args, int i, double &value)
+   {
+      value = args.inFp<1>(i)[0];
+   }
+
+   static inline void Read(ArgHandle &args, int i, SeExpr2::Vec3d &value)
+   {
+      SeExpr2::Vec<double, 3, true> v = args.inFp<3>(i);
+      value = SeExpr2::Vec3d(v[0], v[1], v[2]);
+   }
+
+   static inline void Write(ArgHandle &args, double value)
+   {
+      args.outFp = value;
+   }
+
+   static inline void Write(ArgHandle &args, const SeExpr2::Vec3d &value)
+   {
+      double *out = &(args.outFp);
+      out[0] = value[0];
+      out[1] = value[1];
+      out[2] = value[2];
+   }
+};
+
+static ArnoldNoise3Func gNoise3Func;
+static ArnoldCellNoise3Func gCellNoise3Func;
+static ArnoldOcclusionFunc gOcclusionFunc;
+static ArnoldTextureFunc gTextureFunc;
+static ArnoldFbmFunc gFbmFunc(false);
+static ArnoldFbmFunc gTurbulenceFunc(true);
+static ArnoldVoronoiFunc gVoronoiFunc;
+static ArnoldCurveFunc<double> gCurveFunc;
+static ArnoldCurveFunc<SeExpr2::Vec3d> gCCurveFunc;
+
+static SeExpr2::ExprFunc gNoise3(gNoise3Func, 1, 4);
+static SeExpr2::ExprFunc gCellNoise3(gCellNoise3Func, 1, 1);
+static SeExpr2::ExprFunc gOcclusion(gOcclusionFunc, 2, 4);
+static SeExpr2::ExprFunc gTexture(gTextureFunc, 1, 7);
+static SeExpr2::ExprFunc gFbm(gFbmFunc, 1, 4);
+static SeExpr2::ExprFunc gTurbulence(gTurbulenceFunc, 1, 4);
+static SeExpr2::ExprFunc gVoronoi(gVoronoiFunc, 1, 7);
+static SeExpr2::ExprFunc gCurve(gCurveFunc, 4, -1);
+static SeExpr2::ExprFunc gCCurve(gCCurveFunc, 4, -1);
+
+struct ArnoldFunction
+{
+   const char *name;
+   SeExpr2::ExprFunc *func;
+};
+
+static ArnoldFunction ArnoldFunctions[] =
+{
+   {"noise3", &gNoise3},
+   {"cellnoise3", &gCellNoise3},
+   {"trace_occlusion", &gOcclusion},
+   {"texture", &gTexture},
+   {"fbm", &gFbm},
+   {"turbulence", &gTurbulence},
+   {"voronoi", &gVoronoi},
+   {"curve", &gCurve},
+   {"ccurve", &gCCurve},
+   {NULL, NULL}
+};
+
+// Functions reading the shading context
+static const char* ShadingFunctions[] =
+{
+   "trace_occlusion",
+   "texture",
+   NULL
+};
+
+
+class ArnoldExpr : public SeExpr2::Expression
+{
+public:
+   
+   // Note: the expression object doesn't reference any node so that it can be
+   //       shared by all the nodes with the same expression and variables
+   //       (see ExprCache)
+   // Uniform sub-expression hoisted out of the per-sample expression
+   struct Fold
+   {
+      ArnoldExpr *expr; // evaluated once per update (owned)
+      int dim;
+      int index; // VarBlock variable index
+      int offset; // offset in per-node folded values array
+   };
+
+   // Unlinked shader parameter or render constant read from VarBlock
+   struct Param
+   {
+      int index; // VarBlock variable index
+      unsigned int var; // index in fvars then vvars
+      int sgvar; // ArnoldSgVar enum for render constants, -1 for shader parameters
+      int dim;
+      int offset; // offset in per-node parameter values array
+   };
+
+   // Position of a sub-expression in source
+   struct SubExpr
+   {
+      int start;
+      int length;
+      int dim;
+
+      inline bool operator<(const SubExpr &rhs) const { return start < rhs.start; }
+   };
+
+   ArnoldExpr(const std::string &e, const std::map<std::string, unsigned int> &varindex, unsigned int numfvars, const std::vector<bool> &linked, EvaluationStrategy be=UseInterpreter)
+      : SeExpr2::Expression(e, SeExpr2::ExprType().FP(3).Varying(), be)
+      , mSgSize(0)
+      , mVarIndex(varindex)
+      , mNumFVars(numfvars)
+      , mLinked(linked)
+      , mReturnDim(3)
+      , mParamSize(0)
+      , mRenderConstants(0)
+      , mFoldSize(0)
+      , mCurveResolution(0)
+      , mCompileTime(0.0)
+   {
+      mOutputIndex = mVarBlockCreator.registerVariable("__output", SeExpr2::ExprType().FP(3).Varying());
+      setVarBlockCreator(&mVarBlockCreator);
+
+      // Unlinked parameters have uniform lifetime so that SeExpr's type
+      //   checking flags the sub-expressions that only depend on them
+      for (std::map<std::string, unsigned int>::const_iterator it=mVarIndex.begin(); it!=mVarIndex.end(); ++it)
+      {
+         if (it->second < mLinked.size() && !mLinked[it->second])
+         {
+            Param param;
+            param.var = it->second;
+            param.sgvar = -1;
+            param.dim = (param.var >= mNumFVars ? 3 : 1);
+            param.index = mVarBlockCreator.registerVariable(it->first, SeExpr2::ExprType().FP(param.dim).Uniform());
+            param.offset = mParamSize;
+            mParams.push_back(param);
+            mParamSize += param.dim;
+         }
+      }
+
+      // Note: referenced sg vars are registered on resolution (see resolveVar)
+   }
+   
+   virtual ~ArnoldExpr()
+   {
+      clearExternals();
+      for (size_t i=0; i<mFolds.size(); ++i)
+      {
+         if (mFolds[i].expr)
+         {
+            delete mFolds[i].expr;
+         }
+      }
+   }
+   
+   virtual SeExpr2::ExprVarRef* resolveVar(const std::string& name) const
+   {
+      // hoisted sub-expressions values
+      SeExpr2::ExprVarRef *ref = mVarBlockCreator.resolveVar(name);
+      if (ref)
+      {
+         return ref;
+      }
+      
+      if (name.length() >= 4 && !strncmp(name.c_str(), "sg::", 4))
+      {
+         // -> found sg var
+         std::string sgname = name.substr(4);
+         ArnoldSgVar *var = new ArnoldSgVar(sgname);
+         if (var->which() == ArnoldSgVar::undefined)
+         {
+            AiMsgWarning("[seexpr] Unsupported shader globals \"%s\"", sgname.c_str());
+            return 0;
+         }
+         else if (var->isRenderConstant())
+         {
+            // doesn't make the expression shading point dependent, the value
+            //   is filled per node along with unlinked parameters (see fillParams)
+            Param param;
+            param.var = 0;
+            param.sgvar = var->which();
+            param.dim = 1;
+            param.index = mVarBlockCreator.registerVariable(name, SeExpr2::ExprType().FP(1).Uniform());
+            param.offset = mParamSize;
+            mParams.push_back(param);
+            mParamSize += param.dim;
+            mRenderConstants |= (1ULL << var->which());
+            delete var;
+            return mVarBlockCreator.resolveVar(name);
+         }
+         else
+         {
+            // values are copied from shader globals to VarBlock before each evaluation
+            var->setStorage(mVarBlockCreator.registerVariable(name, SeExpr2::ExprType().FP(var->dim()).Varying()), mSgSize);
+            mSgSize += var->dim();
+            mSgVars.push_back(var);
+            if (var->which() == ArnoldSgVar::sample_frame)
+            {
+               mRenderConstants |= (1ULL << var->which());
+            }
+            return mVarBlockCreator.resolveVar(name);
+         }
+      }
+      else if (name.length() >= 6 && !strncmp(name.c_str(), "user::", 6))
+      {
+         // without any further specification, use broad vector type
+         std::string uname = name.substr(6);
+         ArnoldUserVar *var = new ArnoldUserVar(uname, ArnoldUserVar::Vector);
+         var->setSlot(mUserVars.size());
+         mUserVars.push_back(var);
+         return var;
+      }
+      else if (name.length() >= 8 && !strncmp(name.c_str(), "user_", 5))
+      {
+         // new type specific prefices for user attributes
+         //   user_v:: -> Float[3]
+         //   user_f:: -> Float
+         //   user_s:: -> String
+         if (!strncmp(name.c_str() + 5, "f::", 3))
+         {
+            std::string uname = name.substr(8);
+            ArnoldUserVar *var = new ArnoldUserVar(uname, ArnoldUserVar::Float);
+            var->setSlot(mUserVars.size());
+            mUserVars.push_back(var);
+            return var;
+         }
+         else if (!strncmp(name.c_str() + 5, "v::", 3))
+         {
+            std::string uname = name.substr(8);
+            ArnoldUserVar *var = new ArnoldUserVar(uname, ArnoldUserVar::Vector);
+            var->setSlot(mUserVars.size());
+            mUserVars.push_back(var);
+            return var;
+         }
+         else if (!strncmp(name.c_str() + 5, "s::", 3))
+         {
+            std::string uname = name.substr(8);
+            ArnoldUserVar *var = new ArnoldUserVar(uname, ArnoldUserVar::String);
+            var->setSlot(mUserVars.size());
+            mUserVars.push_back(var);
+            return var;
+         }
+      }
+
+      // Note: this code is only called for used variables!
+      std::map<std::string, unsigned int>::const_iterator varit = mVarIndex.find(name);
+      if (varit != mVarIndex.end())
+      {
+         bool isVec = (varit->second >= mNumFVars);
+         ArnoldShaderVar *var = new ArnoldShaderVar(name, varit->second, (isVec ? varit->second - mNumFVars : varit->second), isVec);
+         mShaderVars.push_back(var);
+         return var;
+      }
+      else
+      {
+         AiMsgWarning("[seexpr] Unknown variable \"%s\"", name.c_str());
+         return 0;
+      }
+   }
+   
+   virtual SeExpr2::ExprFunc* resolveFunc(const std::string &name) const
+   {
+      for (int i=0; ArnoldFunctions[i].name != NULL; ++i)
+      {
+         if (name == ArnoldFunctions[i].name)
+         {
+            return ArnoldFunctions[i].func;
+         }
+      }
+      // fallback to SeExpr built-ins
+      return 0;
+   }
+
+   // Note: resolveVar, resolveFunc are called when compiling the function
+   //       or is that fhe first time the function is run???
+
+   void initBindings(ArnoldBindings &b, AtNode *node, SeExpr2::VarBlock *varBlock=0) const
+   {
+      b.node = node;
+      b.sg = 0;
+      b.fvalues = 0;
+      b.vvalues = 0;
+      b.constants = 0;
+      b.shapeTypes = 0;
+      b.links = 0;
+      b.textures = 0;
+      b.sample = 0;
+      b.linkStamps.assign(mVarIndex.size(), 0);
+      b.linkValues.resize(3 * mVarIndex.size(), 0.0);
+      b.userTypes.resize(mUserVars.size(), AI_TYPE_UNDEFINED);
+      b.userShapes.resize(mUserVars.size(), 0);
+      b.sgValues.resize(mSgSize, 0.0);
+      if (varBlock)
+      {
+         for (size_t i=0; i<mSgVars.size(); ++i)
+         {
+            varBlock->Pointer(mSgVars[i]->index()) = b.sgValues.data() + mSgVars[i]->valueOffset();
+         }
+      }
+   }
+
+   // Copy referenced shader globals to VarBlock storage, user data types are
+   //   resolved per shape on evaluation
+   inline void bindExternals(ArnoldBindings &b, AtShaderGlobals *sg) const
+   {
+      b.sg = sg;
+      for (size_t i=0; i<mSgVars.size(); ++i)
+      {
+         mSgVars[i]->read(sg, *(b.constants), &(b.sgValues[mSgVars[i]->valueOffset()]));
+      }
+   }
+
+   // Also starts a new evaluation: linked values are read again on first access
+   void bindShaderParams(ArnoldBindings &b, AtArray *fvalues, AtArray *vvalues, const ParamLink *links) const
+   {
+      b.fvalues = fvalues;
+      b.vvalues = vvalues;
+      b.links = links;
+      if (++b.sample == 0)
+      {
+         b.linkStamps.assign(b.linkStamps.size(), 0);
+         b.sample = 1;
+      }
+   }
+
+   void clearExternals()
+   {
+      for (std::vector<ArnoldSgVar*>::iterator it=mSgVars.begin(); it!=mSgVars.end(); ++it)
+      {
+         delete *it;
+      }
+      for (std::vector<ArnoldUserVar*>::iterator it=mUserVars.begin(); it!=mUserVars.end(); ++it)
+      {
+         delete *it;
+      }
+      for (std::vector<ArnoldShaderVar*>::iterator it=mShaderVars.begin(); it!=mShaderVars.end(); ++it)
+      {
+         delete *it;
+      }
+      mSgVars.clear();
+      mSgSize = 0;
+      mUserVars.clear();
+      mShaderVars.clear();
+   }
+
+   inline size_t numSgVars() const { return mSgVars.size(); }
+   inline size_t numUserVars() const { return mUserVars.size(); }
+   inline size_t numShaderVars() const { return mShaderVars.size(); }
+   inline int outputIndex() const { return mOutputIndex; }
+   inline bool usesLLVM() const { return (_evaluationStrategy == UseLLVM); }
+   inline EvaluationStrategy evaluationStrategy() const { return _evaluationStrategy; }
+
+   // Whether a thread unsafe function isn't listed in PrivateStateFunctions
+   bool usesGlobalStateFunc() const
+   {
+      const std::vector<std::string> &calls = getThreadUnsafeFunctionCalls();
+      for (size_t i=0; i<calls.size(); ++i)
+      {
+         bool privateState = false;
+         for (int j=0; PrivateStateFunctions[j] != NULL && !privateState; ++j)
+         {
+            privateState = (calls[i] == PrivateStateFunctions[j]);
+         }
+         if (!privateState)
+         {
+            return true;
+         }
+      }
+      return false;
+   }
+   std::string threadUnsafeFunctions() const
+   {
+      // one entry per call, list each function once
+      const std::vector<std::string> &calls = getThreadUnsafeFunctionCalls();
+      std::string names;
+      for (size_t i=0; i<calls.size(); ++i)
+      {
+         if (std::find(calls.begin(), calls.begin() + i, calls[i]) == calls.begin() + i)
+         {
+            names += (names.empty() ? "" : ", ") + calls[i];
+         }
+      }
+      return names;
+   }
+   bool usesShadingFunc() const
+   {
+      for (int i=0; ShadingFunctions[i] != NULL; ++i)
+      {
+         if (usesFunc(ShadingFunctions[i]))
+         {
+            return true;
+         }
+      }
+      return false;
+   }
+   inline double compileTime() const { return mCompileTime; }
+   inline const std::string& cacheKey() const { return mCacheKey; }
+   inline void setCacheKey(const std::string &key) { mCacheKey = key; }
+
+   inline int returnDim() const { return mReturnDim; }
+   inline int curveResolution() const { return mCurveResolution; }
+   inline void setCurveResolution(int resolution) { mCurveResolution = resolution; }
+   inline size_t numFolds() const { return mFolds.size(); }
+   inline const Fold& fold(size_t i) const { return mFolds[i]; }
+   inline int foldSize() const { return mFoldSize; }
+   inline int paramSize() const { return mParamSize; }
+
+   // Copy unlinked parameter and render constant values (once per update)
+   void fillParams(double *values, AtArray *fvalues, AtArray *vvalues, const RenderConstants &constants) const
+   {
+      for (size_t i=0; i<mParams.size(); ++i)
+      {
+         const Param &param = mParams[i];
+         double *value = values + param.offset;
+         if (param.sgvar >= 0)
+         {
+            value[0] = constants.value(param.sgvar);
+         }
+         else if (param.dim == 1)
+         {
+            value[0] = (param.var < fvalues->nelements ? AiArrayGetFlt(fvalues, param.var) : 0.0);
+         }
+         else
+         {
+            unsigned int index = param.var - mNumFVars;
+            AtVector v = (index < vvalues->nelements ? AiArrayGetVec(vvalues, index) : AI_V3_ZERO);
+            value[0] = v.x;
+            value[1] = v.y;
+            value[2] = v.z;
+         }
+      }
+   }
+
+   void bindParams(SeExpr2::VarBlock *varBlock, double *values) const
+   {
+      for (size_t i=0; i<mParams.size(); ++i)
+      {
+         varBlock->Pointer(mParams[i].index) = values + mParams[i].offset;
+      }
+   }
+
+   // Render constants (1 << ArnoldSgVar enum) read by the expression or its
+   //   hoisted sub-expressions
+   unsigned long long renderConstants() const
+   {
+      unsigned long long mask = mRenderConstants;
+      for (size_t i=0; i<mFolds.size(); ++i)
+      {
+         if (mFolds[i].expr)
+         {
+            mask |= mFolds[i].expr->renderConstants();
+         }
+      }
+      return mask;
+   }
+
+   void setReturnDim(int dim)
+   {
+      mReturnDim = dim;
+      setDesiredReturnType(SeExpr2::ExprType().FP(dim).Varying());
+   }
+
+   // Declare the VarBlock variable receiving a hoisted sub-expression value
+   //   (must be called before compile, in '$__foldN' order)
+   void addFold(int dim)
+   {
+      char name[32];
+      Fold fold;
+      sprintf(name, "__fold%d", int(mFolds.size()));
+      fold.expr = 0;
+      fold.dim = dim;
+      fold.index = mVarBlockCreator.registerVariable(name, SeExpr2::ExprType().FP(dim).Varying());
+      fold.offset = mFoldSize;
+      mFolds.push_back(fold);
+      mFoldSize += dim;
+   }
+
+   void setFoldExpr(size_t i, ArnoldExpr *expr)
+   {
+      mFolds[i].expr = expr;
+   }
+
+   void bindFolds(SeExpr2::VarBlock *varBlock, double *values) const
+   {
+      for (size_t i=0; i<mFolds.size(); ++i)
+      {
+         varBlock->Pointer(mFolds[i].index) = values + mFolds[i].offset;
+      }
+   }
+
+   // Collect the largest sub-expressions only depending on constant inputs
+   void findUniformSubExprs(std::vector<SubExpr> &subs) const
+   {
+      if (_parseTree)
+      {
+         findUniformSubExprs(_parseTree, subs);
+      }
+      std::sort(subs.begin(), subs.end());
+   }
+
+   // Position of the final (result) expression in source
+   bool resultRange(int &start, int &length) const
+   {
+      const SeExpr2::ExprNode *block = _parseTree;
+      
+      while (block && !dynamic_cast<const SeExpr2::ExprBlockNode*>(block))
+      {
+         // module node: local functions definitions then block
+         block = (block->numChildren() > 0 ? block->child(block->numChildren() - 1) : 0);
+      }
+      
+      if (!block || block->numChildren() != 2)
+      {
+         return false;
+      }
+      
+      start = block->child(1)->startPos();
+      length = block->child(1)->length();
+      
+      return true;
+   }
+
+   // Private copy of this expression (for thread unsafe expressions)
+   ArnoldExpr* createInstance() const
+   {
+      ArnoldExpr *expr = new ArnoldExpr(getExpr(), mVarIndex, mNumFVars, mLinked, _evaluationStrategy);
+      expr->setReturnDim(mReturnDim);
+      expr->setCurveResolution(mCurveResolution);
+      for (size_t i=0; i<mFolds.size(); ++i)
+      {
+         expr->addFold(mFolds[i].dim);
+      }
+      expr->compile();
+      return expr;
+   }
+
+   // Parse and prepare (JIT compile for LLVM backend), returns validity
+   bool compile()
+   {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      bool valid = isValid();
+      mCompileTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      return valid;
+   }
+
+   // Constant paths passed to texture(), one handle per path and node
+   //   Registered by ArnoldTextureFunc::prep in parse tree order, so that a
+   //   private copy of the expression (see createInstance) gets the same slots
+   inline const std::vector<std::string>& texturePaths() const { return mTexturePaths; }
+
+   void addTexturePath(const char *path) const
+   {
+      if (textureSlot(path) < 0)
+      {
+         mTexturePaths.push_back(path);
+      }
+   }
+
+   int textureSlot(const char *path) const
+   {
+      std::vector<std::string>::const_iterator it = std::find(mTexturePaths.begin(), mTexturePaths.end(), path);
+      return (it != mTexturePaths.end() ? int(it - mTexturePaths.begin()) : -1);
+   }
+
+   SeExpr2::VarBlock* createVarBlock(void *storage)
+   {
+      // thread safe var blocks hold their own copy of the interpreter state
+      //   so that a single compiled expression can be evaluated concurrently
+      return new (storage) SeExpr2::VarBlock(mVarBlockCreator.create(true));
+   }
+
+private:
+
+   void findUniformSubExprs(const SeExpr2::ExprNode *node, std::vector<SubExpr> &subs) const
+   {
+      if (isFoldable(node))
+      {
+         SubExpr sub;
+         sub.start = node->startPos();
+         sub.length = node->length();
+         sub.dim = node->type().dim();
+         subs.push_back(sub);
+      }
+      else
+      {
+         for (int i=0; i<node->numChildren(); ++i)
+         {
+            findUniformSubExprs(node->child(i), subs);
+         }
+      }
+   }
+
+   bool isFoldable(const SeExpr2::ExprNode *node) const
+   {
+      const SeExpr2::ExprType &type = node->type();
+
+      if (!type.isFP() || !(type.isLifetimeConstant() || type.isLifetimeUniform()))
+      {
+         return false;
+      }
+      // only value producing nodes, nothing to gain on single numbers or variables
+      if (!dynamic_cast<const SeExpr2::ExprBinaryOpNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprUnaryOpNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprCompareNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprCompareEqNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprCondNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprAndNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprOrNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprSubscriptNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprVecNode*>(node) &&
+          !dynamic_cast<const SeExpr2::ExprFuncNode*>(node))
+      {
+         return false;
+      }
+      return isStandalone(node);
+   }
+
+   // Sub-expression can be evaluated on its own (no local variable reference)
+   bool isStandalone(const SeExpr2::ExprNode *node) const
+   {
+      const SeExpr2::ExprVarNode *var = dynamic_cast<const SeExpr2::ExprVarNode*>(node);
+      if (var)
+      {
+         const SeExpr2::VarBlockCreator::Ref *ref = dynamic_cast<const SeExpr2::VarBlockCreator::Ref*>(var->var());
+         // unlinked parameters or render constants
+         if (!(ref && ref->type().isLifetimeUniform()))
+         {
+            return false;
+         }
+      }
+      for (int i=0; i<node->numChildren(); ++i)
+      {
+         if (!isStandalone(node->child(i)))
+         {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   mutable std::vector<ArnoldSgVar*> mSgVars;
+   mutable int mSgSize;
+   mutable std::vector<ArnoldUserVar*> mUserVars;
+   mutable std::vector<ArnoldShaderVar*> mShaderVars;
+   std::map<std::string, unsigned int> mVarIndex;
+   unsigned int mNumFVars;
+   std::vector<bool> mLinked;
+   int mReturnDim;
+   mutable std::vector<Param> mParams;
+   mutable int mParamSize;
+   mutable unsigned long long mRenderConstants;
+   std::vector<Fold> mFolds;
+   int mFoldSize;
+   mutable SeExpr2::VarBlockCreator mVarBlockCreator;
+   int mOutputIndex;
+   mutable std::vector<std::string> mTexturePaths;
+   int mCurveResolution; // curve()/ccurve() table size (0 for exact evaluation)
+   std::string mCacheKey;
+   double mCompileTime; // in milliseconds
+};
+
+void ArnoldTextureFunc::RegisterPath(const SeExpr2::ExprFuncNode *node)
+{
+   const ArnoldExpr *expr = dynamic_cast<const ArnoldExpr*>(node->expr());
+   const SeExpr2::ExprStrNode *str = dynamic_cast<const SeExpr2::ExprStrNode*>(node->child(0));
+   if (expr && str)
+   {
+      expr->addTexturePath(str->str());
+   }
+}
+
+SeExpr2::ExprFuncNode::Data* ArnoldTextureFunc::evalConstant(const SeExpr2::ExprFuncNode *node, ArgHandle&) const
+{
+   Data *data = new Data();
+   const ArnoldExpr *expr = dynamic_cast<const ArnoldExpr*>(node->expr());
+   const SeExpr2::ExprStrNode *str = dynamic_cast<const SeExpr2::ExprStrNode*>(node->child(0));
+   data->slot = (expr && str ? expr->textureSlot(str->str()) : -1);
+   if (expr && str && data->slot < 0)
+   {
+      // the lookup still works, resolving the path on every call
+      AiMsgWarning("[seexpr] No texture handle slot for constant path \"%s\"", str->str());
+   }
+   return data;
+}
+
+template <typename T>
+SeExpr2::ExprFuncNode::Data* ArnoldCurveFunc<T>::evalConstant(const SeExpr2::ExprFuncNode *node, ArgHandle &args) const
+{
+   Data *data = new Data();
+   const ArnoldExpr *expr = dynamic_cast<const ArnoldExpr*>(node->expr());
+   double pmin = 0.0;
+   double pmax = 0.0;
+   bool exact = false;
+   
+   for (int i=1; i+2<args.nargs(); i+=3)
+   {
+      double pos = args.inFp<1>(i)[0];
+      T value;
+      Read(args, i+1, value);
+      int interp = int(args.inFp<1>(i+2)[0]);
+      if (interp < int(SeExpr2::Curve<T>::kNone) || interp > int(SeExpr2::Curve<T>::kMonotoneSpline))
+      {
+         interp = int(SeExpr2::Curve<T>::kNone);
+      }
+      // steps can't be interpolated from a table
+      exact = exact || (interp == int(SeExpr2::Curve<T>::kNone));
+      pmin = (i == 1 ? pos : std::min(pmin, pos));
+      pmax = (i == 1 ? pos : std::max(pmax, pos));
+      data->curve.addPoint(pos, value, typename SeExpr2::Curve<T>::InterpType(interp));
+   }
+   data->curve.preparePoints();
+   
+   int resolution = (expr ? expr->curveResolution() : 0);
+   if (!exact && resolution > 1 && pmax > pmin)
+   {
+      data->build(resolution, pmin, pmax);
+   }
+   
+   return data;
+}
+
+// Process wide compiled expressions cache
+//   Nodes with the same expression and the same variables signature share a
+//   single compiled ArnoldExpr object (reference counted)
+class ExprCache
+{
+public:
+
+   static std::string Key(const std::string &source, int backend, int dim, int curveResolution, AtArray *fnames, AtArray *vnames, const std::vector<bool> &linked, const std::vector<std::string> &onames)
+   {
+      char tmp[32];
+      sprintf(tmp, "%d:%d", dim, curveResolution);
+      std::string key = SeExprBackendNames[backend];
+      key += '\0';
+      key += tmp;
+      key += '\0';
+      key += source;
+      key += '\0';
+      for (unsigned int i=0; i<fnames->nelements; ++i)
+      {
+         key += (linked[i] ? "fl:" : "f:");
+         key += AiArrayGetStr(fnames, i);
+         key += '\0';
+      }
+      for (unsigned int i=0; i<vnames->nelements; ++i)
+      {
+         key += (linked[fnames->nelements + i] ? "vl:" : "v:");
+         key += AiArrayGetStr(vnames, i);
+         key += '\0';
+      }
+      for (size_t i=0; i<onames.size(); ++i)
+      {
+         key += "o:";
+         key += onames[i];
+         key += '\0';
+      }
+      return key;
+   }
+
+   // Returns 0 if key is not yet in the cache
+   static ArnoldExpr* Acquire(const std::string &key)
+   {
+      std::lock_guard<std::mutex> lock(sMutex);
+      std::map<std::string, Entry>::iterator it = sEntries.find(key);
+      if (it != sEntries.end())
+      {
+         ++(it->second.refcount);
+         ++sHits;
+         return it->second.expr;
+      }
+      else
+      {
+         ++sMisses;
+         return 0;
+      }
+   }
+
+   // Returns the cached object, expr is deleted if another node inserted
+   //   the same key in the meantime
+   static ArnoldExpr* Insert(const std::string &key, ArnoldExpr *expr)
+   {
+      std::lock_guard<std::mutex> lock(sMutex);
+      std::map<std::string, Entry>::iterator it = sEntries.find(key);
+      if (it != sEntries.end())
+      {
+         ++(it->second.refcount);
+         delete expr;
+         return it->second.expr;
+      }
+      else
+      {
+         Entry &entry = sEntries[key];
+         entry.expr = expr;
+         entry.refcount = 1;
+         expr->setCacheKey(key);
+         return expr;
+      }
+   }
+
+   static void Release(ArnoldExpr *expr)
+   {
+      std::lock_guard<std::mutex> lock(sMutex);
+      std::map<std::string, Entry>::iterator it = sEntries.find(expr->cacheKey());
+      if (it != sEntries.end() && it->second.expr == expr)
+      {
+         if (--(it->second.refcount) == 0)
+         {
+            delete expr;
+            sEntries.erase(it);
+         }
+      }
+   }
+
+   static void NodeInitialized()
+   {
+      std::lock_guard<std::mutex> lock(sMutex);
+      ++sNodes;
+   }
+
+   // Report statistics once the last node is gone (render end), returns true then
+   static bool NodeFinished()
+   {
+      std::lock_guard<std::mutex> lock(sMutex);
+      if (--sNodes == 0)
+      {
+         if (sHits + sMisses > 0)
+         {
+            AiMsgInfo("[seexpr] Expression cache: %u hit(s), %u miss(es)", sHits, sMisses);
+         }
+         sHits = 0;
+         sMisses = 0;
+         return true;
+      }
+      return false;
+   }
+
+private:
+
+   struct Entry
+   {
+      ArnoldExpr *expr;
+      unsigned int refcount;
+   };
+
+   static std::mutex sMutex;
+   static std::map<std::string, Entry> sEntries;
+   static unsigned int sNodes;
+   static unsigned int sHits;
+   static unsigned int sMisses;
+};
+
+std::mutex ExprCache::sMutex;
+std::map<std::string, ExprCache::Entry> ExprCache::sEntries;
+unsigned int ExprCache::sNodes = 0;
+unsigned int ExprCache::sHits = 0;
+unsigned int ExprCache::sMisses = 0;
+
+// ---
+
+// Context bound to the node's current expression
+static SeExprThreadData* NewThreadData(SeExprData *data)
+{
+   // over-allocate so that the context starts on a cache line
+   void *mem = ::operator new(sizeof(SeExprThreadData) + SEEXPR_CACHE_LINE_SIZE);
+   size_t addr = (reinterpret_cast<size_t>(mem) + SEEXPR_CACHE_LINE_SIZE - 1) & ~size_t(SEEXPR_CACHE_LINE_SIZE - 1);
+   
+   SeExprThreadData *td = new (reinterpret_cast<void*>(addr)) SeExprThreadData();
+   td->mem = mem;
+   td->expr = 0;
+   td->bindings.node = 0;
+   td->bindings.sg = 0;
+   td->mutexWaitTime = 0.0;
+   td->serializedEvals = 0;
+   td->outputStamped = false;
+   td->memoValid = false;
+   td->memoHits = 0;
+   td->memoMisses = 0;
+   td->varBlock = data->expr->createVarBlock(&(td->varBlockStorage));
+   td->outputStorage = data->value;
+   td->output = td->outputStorage.data();
+   td->varBlock->Pointer(data->outputIndex) = td->output;
+   data->expr->bindParams(td->varBlock, data->paramValues.data());
+   data->expr->bindFolds(td->varBlock, data->foldValues.data());
+   
+   return td;
+}
+
+static void DeleteThreadData(SeExprThreadData *td)
+{
+   void *mem = td->mem;
+   td->varBlock->~VarBlock();
+   if (td->expr)
+   {
+      delete td->expr;
+   }
+   td->~SeExprThreadData();
+   ::operator delete(mem);
+}
+
+// Calling thread context, created on its first evaluation of the node
+static inline SeExprThreadData* GetThreadData(SeExprData *data, int tid)
+{
+   SeExprThreadData *td = data->threads.Get(tid);
+   if (!td)
+   {
+      td = NewThreadData(data);
+      data->threads.Set(tid, td);
+   }
+   return td;
+}
+
+// Calling thread statistics for a constant node, a full context isn't needed
+static inline EvalStats* GetConstantStats(SeExprData *data, int tid)
+{
+   EvalStats *stats = data->constantStats.Get(tid);
+   if (!stats)
+   {
+      stats = new EvalStats();
+      data->constantStats.Set(tid, stats);
+   }
+   return stats;
+}
+
+// Move per-thread counters to the node totals, dropped if statistics are off
+//   Called before the 'seexpr_stats' setting changes (see node_update)
+static void CollectThreadStats(SeExprData *data)
+{
+   data->threads.ForEach([data](SeExprThreadData *td)
+   {
+      if (data->stats)
+      {
+         data->evalStats.merge(td->stats);
+         data->memoHits += td->memoHits;
+         data->memoMisses += td->memoMisses;
+         data->serializedEvals += td->serializedEvals;
+         data->mutexWaitTime += td->mutexWaitTime;
+      }
+      td->stats.reset();
+      td->memoHits = 0;
+      td->memoMisses = 0;
+      td->serializedEvals = 0;
+      td->mutexWaitTime = 0.0;
+   });
+   data->constantStats.ForEach([data](EvalStats *stats)
+   {
+      if (data->stats)
+      {
+         data->evalStats.merge(*stats);
+      }
+      stats->reset();
+   });
+}
+
+static void DestroyThreadData(SeExprData *data)
+{
+   CollectThreadStats(data);
+   data->threads.ForEach([](SeExprThreadData *td)
+   {
+      DeleteThreadData(td);
+   });
+   data->threads.Clear();
+   data->constantStats.ForEach([](EvalStats *stats)
+   {
+      delete stats;
+   });
+   data->constantStats.Clear();
+}
+
+static void DestroyTextures(SeExprData *data)
+{
+   for (size_t i=0; i<data->textures.size(); ++i)
+   {
+      if (data->textures[i])
+      {
+         AiTextureHandleDestroy(data->textures[i]);
+      }
+   }
+   data->textures.clear();
+}
+
+// Release the compiled expression and everything derived from it
+static void ResetExpr(SeExprData *data)
+{
+   DestroyThreadData(data);
+   DestroyTextures(data);
+
+   if (data->mutex)
+   {
+      AiCritSecClose(&(data->mutex));
+      data->mutex = 0;
+   }
+
+   if (data->expr)
+   {
+      ExprCache::Release(data->expr);
+      data->expr = 0;
+   }
+
+   data->shapeTypes.clear();
+   data->pending = false;
+   data->valid = false;
+   data->constant = false;
+   data->threadsafe = false;
+   data->sgdependent = false;
+   data->memoize = false;
+   data->value.assign(std::max(data->returnDim, 4), 0.0);
+   data->value[3] = 1.0;
+   data->paramValues.clear();
+   data->foldValues.clear();
+}
+
+static ArnoldExpr* NewExpr(AtNode *node, SeExprData *data, const std::string &source, int dim, const std::vector<int> &foldDims, int backend)
+{
+   ArnoldExpr *expr = new ArnoldExpr(source, data->varindex, data->numfvars, data->linked, (backend == b_llvm ? SeExpr2::Expression::UseLLVM : SeExpr2::Expression::UseInterpreter));
+   expr->setReturnDim(dim);
+   expr->setCurveResolution(data->curveResolution);
+   for (size_t i=0; i<foldDims.size(); ++i)
+   {
+      expr->addFold(foldDims[i]);
+   }
+   // parse and prepare before the expression gets shared
+   if (!expr->compile() && expr->usesLLVM())
+   {
+      ArnoldExpr *iexpr = NewExpr(node, data, source, dim, foldDims, b_interpreter);
+      if (iexpr->isValid())
+      {
+         AiMsgWarning("[seexpr] JIT setup failed for node \"%s\" (%s). Fallback to interpreter.", AiNodeGetName(node), expr->parseError().c_str());
+      }
+      delete expr;
+      expr = iexpr;
+   }
+   return expr;
+}
+
+// Rewrite source so that the expression returns its result followed by the
+//   named local variables (3 components each)
+static bool PackOutputs(AtNode *node, SeExprData *data, std::string &source)
+{
+   std::vector<int> foldDims;
+   
+   ArnoldExpr *expr = NewExpr(node, data, data->source, data->outputDim, foldDims, b_interpreter);
+   
+   int start = 0;
+   int length = 0;
+   
+   if (!expr->isValid() || !expr->resultRange(start, length))
+   {
+      delete expr;
+      return false;
+   }
+   
+   delete expr;
+   
+   char tmp[64];
+   std::string components;
+   
+   source = data->source.substr(0, start);
+   source += "\n$__result = (" + data->source.substr(start, length) + ")";
+   if (data->outputDim > 1)
+   {
+      source += (data->outputDim == 4 ? " * [1, 1, 1, 1]" : " * [1, 1, 1]");
+   }
+   source += ";\n";
+   
+   for (int i=0; i<data->outputDim; ++i)
+   {
+      if (data->outputDim == 1)
+      {
+         components += "$__result";
+      }
+      else
+      {
+         sprintf(tmp, "%s$__result[%d]", (i > 0 ? ", " : ""), i);
+         components += tmp;
+      }
+   }
+   
+   for (size_t i=0; i<data->outputNames.size(); ++i)
+   {
+      sprintf(tmp, "$__output%d = ($", int(i));
+      source += tmp + data->outputNames[i] + ") * [1, 1, 1];\n";
+      for (int j=0; j<3; ++j)
+      {
+         sprintf(tmp, ", $__output%d[%d]", int(i), j);
+         components += tmp;
+      }
+   }
+   
+   source += "[" + components + "]\n";
+   
+   return true;
+}
+
+static ArnoldExpr* CompileExpr(AtNode *node, SeExprData *data, int backend)
+{
+   std::vector<int> foldDims;
+   std::string base = data->source;
+   
+   if (data->outputNames.size() > 0)
+   {
+      if (!PackOutputs(node, data, base))
+      {
+         // report errors on original expression
+         return NewExpr(node, data, data->source, data->returnDim, foldDims, backend);
+      }
+   }
+   
+   ArnoldExpr *expr = NewExpr(node, data, base, data->returnDim, foldDims, backend);
+   
+   if (!expr->isValid() || expr->isConstant())
+   {
+      return expr;
+   }
+
+   // Hoist sub-expressions only depending on unlinked parameters and render constants
+   std::vector<ArnoldExpr::SubExpr> subs;
+   std::vector<ArnoldExpr*> folds;
+   std::string source = base;
+
+   expr->findUniformSubExprs(subs);
+
+   for (size_t i=0; i<subs.size(); ++i)
+   {
+      // uniform values are evaluated once per update, interpreter is enough
+      ArnoldExpr *fexpr = NewExpr(node, data, base.substr(subs[i].start, subs[i].length), subs[i].dim, foldDims, b_interpreter);
+      if (fexpr->isValid() && fexpr->isThreadSafe())
+      {
+         folds.push_back(fexpr);
+      }
+      else
+      {
+         delete fexpr;
+         subs.erase(subs.begin() + i);
+         --i;
+      }
+   }
+
+   if (folds.empty())
+   {
+      return expr;
+   }
+
+   // Replace from the end so that preceding positions stay valid
+   for (size_t i=subs.size(); i>0; --i)
+   {
+      char name[32];
+      sprintf(name, "$__fold%d", int(i - 1));
+      source.replace(subs[i-1].start, subs[i-1].length, name);
+   }
+   for (size_t i=0; i<subs.size(); ++i)
+   {
+      foldDims.push_back(subs[i].dim);
+   }
+
+   ArnoldExpr *hexpr = NewExpr(node, data, source, data->returnDim, foldDims, backend);
+   
+   if (!hexpr->isValid())
+   {
+      AiMsgDebug("[seexpr] Failed to hoist uniform sub-expression(s) for node \"%s\" (%s)", AiNodeGetName(node), hexpr->parseError().c_str());
+      delete hexpr;
+      for (size_t i=0; i<folds.size(); ++i)
+      {
+         delete folds[i];
+      }
+      return expr;
+   }
+   
+   AiMsgDebug("[seexpr] Hoisted %d uniform sub-expression(s) for node \"%s\"", int(folds.size()), AiNodeGetName(node));
+   
+   for (size_t i=0; i<folds.size(); ++i)
+   {
+      hexpr->setFoldExpr(i, folds[i]);
+   }
+   
+   delete expr;
+   
+   return hexpr;
+}
+
+// Evaluate expression only depending on unlinked parameters (no shading context)
+static void EvalUniform(AtNode *node, ArnoldExpr *expr, const RenderConstants &constants, double *foldValues, double *result)
+{
+   std::aligned_storage<sizeof(SeExpr2::VarBlock), alignof(SeExpr2::VarBlock)>::type storage;
+   
+   std::vector<double> paramValues(expr->paramSize());
+   
+   SeExpr2::VarBlock *varBlock = expr->createVarBlock(&storage);
+   varBlock->Pointer(expr->outputIndex()) = result;
+   expr->fillParams(paramValues.data(), AiNodeGetArray(node, SSTR::fparam_value), AiNodeGetArray(node, SSTR::vparam_value), constants);
+   expr->bindParams(varBlock, paramValues.data());
+   expr->bindFolds(varBlock, foldValues);
+
+   ArnoldBindings bindings;
+   expr->initBindings(bindings, node);
+   bindings.constants = &constants;
+   expr->bindShaderParams(bindings, AiNodeGetArray(node, SSTR::fparam_value), AiNodeGetArray(node, SSTR::vparam_value), 0);
+   
+   ArnoldBindings *prevBindings = gBindings;
+   gBindings = &bindings;
+   
+   expr->evalMultiple(varBlock, expr->outputIndex(), 0, 1);
+   
+   gBindings = prevBindings;
+   
+   varBlock->~VarBlock();
+}
+
+static bool GetParamLink(AtNode *node, const char *param, ParamLink &link, int i)
+{
+   if (i == 0)
+   {
+      memset(&link, 0, sizeof(ParamLink));
+   }
+   link.comp[i] = -1;
+   link.node[i] = AiNodeGetLink(node, param, &(link.comp[i]));
+   if (link.node[i])
+   {
+      link.type[i] = AiNodeEntryGetOutputType(AiNodeGetNodeEntry(link.node[i]));
+      link.linked = true;
+      link.whole = (i == 0 && !strchr(param, '.'));
+      return true;
+   }
+   return false;
+}
+
+static bool GetOptionsBackend(int &backend)
+{
+   AtNode *opts = AiUniverseGetOptions();
+   const AtUserParamEntry *pe = AiNodeLookUpUserParameter(opts, SSTR::seexpr_backend);
+   if (pe != 0)
+   {
+      if (AiUserParamGetCategory(pe) == AI_USERDEF_CONSTANT && AiUserParamGetType(pe) == AI_TYPE_STRING)
+      {
+         const char *name = AiNodeGetStr(opts, SSTR::seexpr_backend);
+         for (int i=0; SeExprBackendNames[i] != NULL; ++i)
+         {
+            if (!strcmp(name, SeExprBackendNames[i]))
+            {
+               backend = i;
+               return true;
+            }
+         }
+      }
+      AiMsgWarning("[seexpr] \"seexpr_backend\" parameter on options node should be a constant string set to one of \"interpreter\" or \"llvm\"");
+   }
+   return false;
+}
+
+// SeExpr built without LLVM support can't honor the 'llvm' backend
+static void CheckBackend(int &backend)
+{
+#ifndef SEEXPR_ENABLE_LLVM
+   if (backend == b_llvm)
+   {
+      static std::atomic<bool> sWarned(false);
+      if (!sWarned.exchange(true))
+      {
+         AiMsgWarning("[seexpr] SeExpr was built without LLVM support, 'llvm' backend falls back to interpreter");
+      }
+      backend = b_interpreter;
+   }
+#endif
+}
+
+// 'seexpr_lazy_compile' constant boolean on options node
+static bool GetOptionsLazyCompile()
+{
+   AtNode *opts = AiUniverseGetOptions();
+   const AtUserParamEntry *pe = AiNodeLookUpUserParameter(opts, SSTR::seexpr_lazy_compile);
+   if (pe != 0)
+   {
+      if (AiUserParamGetCategory(pe) == AI_USERDEF_CONSTANT && AiUserParamGetType(pe) == AI_TYPE_BOOLEAN)
+      {
+         return AiNodeGetBool(opts, SSTR::seexpr_lazy_compile);
+      }
+      AiMsgWarning("[seexpr] \"seexpr_lazy_compile\" parameter on options node should be a constant boolean");
+   }
+   return false;
+}
+
+// 'seexpr_compile_threads' constant integer on options node (0: compile in
+//   node_update, negative: all cores but that many), returns worker count
+static int GetOptionsCompileThreads()
+{
+   AtNode *opts = AiUniverseGetOptions();
+   const AtUserParamEntry *pe = AiNodeLookUpUserParameter(opts, SSTR::seexpr_compile_threads);
+   if (pe != 0)
+   {
+      if (AiUserParamGetCategory(pe) == AI_USERDEF_CONSTANT && AiUserParamGetType(pe) == AI_TYPE_INT)
+      {
+         int count = AiNodeGetInt(opts, SSTR::seexpr_compile_threads);
+         if (count < 0)
+         {
+            count = std::max(1, int(std::thread::hardware_concurrency()) + count);
+         }
+         return count;
+      }
+      AiMsgWarning("[seexpr] \"seexpr_compile_threads\" parameter on options node should be a constant integer");
+   }
+   return 0;
+}
+
+// 'seexpr_stats' constant boolean and 'seexpr_stats_file' constant string on
+//   options node, statistics are enabled if either one is set
+static bool GetOptionsStats(std::string &file)
+{
+   AtNode *opts = AiUniverseGetOptions();
+   bool enabled = false;
+   const AtUserParamEntry *pe = AiNodeLookUpUserParameter(opts, SSTR::seexpr_stats);
+   if (pe != 0)
+   {
+      if (AiUserParamGetCategory(pe) == AI_USERDEF_CONSTANT && AiUserParamGetType(pe) == AI_TYPE_BOOLEAN)
+      {
+         enabled = AiNodeGetBool(opts, SSTR::seexpr_stats);
+      }
+      else
+      {
+         AiMsgWarning("[seexpr] \"seexpr_stats\" parameter on options node should be a constant boolean");
+      }
+   }
+   file = "";
+   pe = AiNodeLookUpUserParameter(opts, SSTR::seexpr_stats_file);
+   if (pe != 0)
+   {
+      if (AiUserParamGetCategory(pe) == AI_USERDEF_CONSTANT && AiUserParamGetType(pe) == AI_TYPE_STRING)
+      {
+         file = AiNodeGetStr(opts, SSTR::seexpr_stats_file);
+      }
+      else
+      {
+         AiMsgWarning("[seexpr] \"seexpr_stats_file\" parameter on options node should be a constant string");
+      }
+   }
+   return (enabled || !file.empty());
+}
+
+// Named outputs access (see seexpr_output.cpp)
+
+int SeExprFindOutput(AtNode *node, const char *name)
+{
+   AtArray *onames = AiNodeGetArray(node, SSTR::output_names);
+   if (onames)
+   {
+      for (unsigned int i=0; i<onames->nelements; ++i)
+      {
+         if (!strcmp(AiArrayGetStr(onames, i), name))
+         {
+            return int(i);
+         }
+      }
+   }
+   return -1;
+}
+
+// Fails if the node wasn't evaluated for this shading query on this thread
+bool SeExprGetOutput(AtNode *node, AtShaderGlobals *sg, int index, AtVector &out)
+{
+   SeExprData *data = (SeExprData*) AiNodeGetLocalData(node);
+   
+   if (!data || !data->valid || index < 0 || index >= int(data->outputNames.size()))
+   {
+      return false;
+   }
+   
+   const double *values = data->value.data();
+   if (!data->constant)
+   {
+      const SeExprThreadData *td = data->threads.Get(sg->tid);
+      if (!td || !td->outputStamped)
+      {
+         return false;
+      }
+      OutputStamp stamp;
+      stamp.set(sg);
+      if (!(stamp == td->outputStamp))
+      {
+         return false;
+      }
+      values = td->output;
+   }
+   
+   values += data->outputDim + 3 * index;
+   
+   out.x = float(values[0]);
+   out.y = float(values[1]);
+   out.z = float(values[2]);
+   
+   return true;
+}
+
+// Expression without any variable or function reference, no thread has to own the context
+static void EvalConstant(SeExprData *data)
+{
+   SeExprThreadData *td = NewThreadData(data);
+   data->expr->evalMultiple(td->varBlock, data->outputIndex, 0, 1);
+   memcpy(data->value.data(), td->output, data->returnDim * sizeof(double));
+   DeleteThreadData(td);
+}
+
+// SeExpr side of the setup: parse, prepare and JIT compile (or get from caches)
+//   Only reads the node's cached SeExprData, safe on compilation threads
+static void PrepareExpr(AtNode *node, SeExprData *data)
+{
+   if (data->expr)
+   {
+      return;
+   }
+   
+   ArnoldExpr *expr = ExprCache::Acquire(data->key);
+   bool compiled = (expr == 0);
+   
+   if (!expr)
+   {
+      expr = ExprCache::Insert(data->key, CompileExpr(node, data, data->backend));
+   }
+
+   if (expr->usesLLVM())
+   {
+      AiMsgDebug("[seexpr] JIT compile time for node \"%s\": %.3f ms%s", AiNodeGetName(node), expr->compileTime(), (compiled ? "" : " (shared)"));
+   }
+   
+   data->expr = expr;
+}
+
+// Prepare the expression (unless a compilation thread already did) and bind
+//   it to Arnold: render constants, parameters, texture handles
+static void SetupExpr(AtNode *node, SeExprData *data)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   
+   data->setups += 1;
+   
+   PrepareExpr(node, data);
+   
+   ArnoldExpr *expr = data->expr;
+   data->outputIndex = expr->outputIndex();
+
+   // Parameters, render constants and hoisted sub-expressions values depend
+   //   on this node, not shared
+   data->constants.read(expr->renderConstants());
+   data->paramValues.resize(expr->paramSize(), 0.0);
+   expr->fillParams(data->paramValues.data(), data->fvalues, data->vvalues, data->constants);
+   
+   data->foldValues.resize(expr->foldSize(), 0.0);
+   for (size_t i=0; i<expr->numFolds(); ++i)
+   {
+      const ArnoldExpr::Fold &fold = expr->fold(i);
+      EvalUniform(node, fold.expr, data->constants, 0, &(data->foldValues[fold.offset]));
+   }
+
+   // Constant texture paths are resolved once, not on every lookup
+   const std::vector<std::string> &paths = expr->texturePaths();
+   for (size_t i=0; i<paths.size(); ++i)
+   {
+      AtTextureHandle *handle = AiTextureHandleCreate(paths[i].c_str());
+      if (!handle)
+      {
+         AiMsgWarning("[seexpr] Failed to create texture handle for \"%s\"", paths[i].c_str());
+      }
+      data->textures.push_back(handle);
+   }
+   if (!paths.empty())
+   {
+      AiMsgDebug("[seexpr] Node \"%s\" uses %u texture handle(s)", AiNodeGetName(node), (unsigned int)paths.size());
+   }
+
+   if (expr->isValid())
+   {
+      data->valid = true;
+      data->threadsafe = expr->isThreadSafe();
+      if (!data->threadsafe)
+      {
+         if (expr->usesGlobalStateFunc())
+         {
+            // Function state is shared beyond the expression object, serialize evaluations
+            AiMsgWarning("[seexpr] Expression for node \"%s\" is not thread safe (%s), evaluation will be serialized", AiNodeGetName(node), expr->threadUnsafeFunctions().c_str());
+            AiCritSecInit(&(data->mutex));
+         }
+         else
+         {
+            // Function state is private to the expression object, use one expression per thread
+            AiMsgDebug("[seexpr] Expression for node \"%s\" is not thread safe (%s), use one expression object per thread", AiNodeGetName(node), expr->threadUnsafeFunctions().c_str());
+         }
+      }
+
+      if (expr->isConstant())
+      {
+         // No vars or func reference (implies threadsafe)
+         data->constant = true;
+         data->sgdependent = false;
+
+         // Do not need to bind externals
+         EvalConstant(data);
+      }
+      else
+      {
+         // Check if expression's input are all constant
+         
+         bool allParamsConstant = true;
+         
+         for (std::map<std::string, unsigned int>::iterator varit = data->varindex.begin(); varit != data->varindex.end(); ++varit)
+         {
+            if (data->linked[varit->second] && expr->usesVar(varit->first))
+            {
+               allParamsConstant = false;
+            }
+         }
+
+         data->sgdependent = (!allParamsConstant || expr->numSgVars() > 0 || expr->numUserVars() > 0 || expr->usesShadingFunc());
+
+         // Linked parameters and shading functions may read any shader global
+         data->memoize = (data->threadsafe && allParamsConstant && !expr->usesShadingFunc());
+
+         if (!data->sgdependent && data->threadsafe)
+         {
+            // Same result for all shading points, evaluate once
+            EvalUniform(node, expr, data->constants, data->foldValues.data(), data->value.data());
+            
+            data->constant = true;
+         }
+         else
+         {
+            // Expression is parsed and prepared once, threads only keep their own bindings
+            AiMsgDebug("[seexpr] Use same expression object for all thread(s)");
+         }
+      }
+   }
+   else
+   {
+      AiMsgWarning("[seexpr] Invalid expression (%s)", expr->parseError().c_str());
+   }
+   
+   if (!data->valid)
+   {
+      data->numfvars = 0;
+      data->numvvars = 0;
+   }
+   
+   AiMsgDebug("[seexpr] Setup of node \"%s\": %.3f ms", AiNodeGetName(node), std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+// IPR update that only changed parameter values: the compiled expression,
+//   texture handles and per-thread contexts are kept, parameter values and
+//   render constants are rebound in place
+static void RebindExpr(AtNode *node, SeExprData *data)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   
+   ArnoldExpr *expr = data->expr;
+   
+   data->rebinds += 1;
+
+   // Options and camera may have changed too (frame, motion range, shutter)
+   data->constants.read(expr->renderConstants());
+
+   // Sizes are unchanged, thread VarBlocks keep pointing at the same storage
+   expr->fillParams(data->paramValues.data(), data->fvalues, data->vvalues, data->constants);
+   
+   for (size_t i=0; i<expr->numFolds(); ++i)
+   {
+      const ArnoldExpr::Fold &fold = expr->fold(i);
+      EvalUniform(node, fold.expr, data->constants, 0, &(data->foldValues[fold.offset]));
+   }
+
+   // Shapes may have been deleted or their user data changed
+   data->shapeTypes.clear();
+
+   data->threads.ForEach([](SeExprThreadData *td)
+   {
+      td->outputStamped = false;
+      td->memoValid = false;
+      td->bindings.userShapes.assign(td->bindings.userShapes.size(), 0);
+   });
+
+   if (data->constant)
+   {
+      if (expr->isConstant())
+      {
+         EvalConstant(data);
+      }
+      else
+      {
+         EvalUniform(node, expr, data->constants, data->foldValues.data(), data->value.data());
+      }
+   }
+   
+   AiMsgDebug("[seexpr] Rebind of node \"%s\": %.3f ms", AiNodeGetName(node), std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+// First evaluation of a node whose compilation was deferred
+static void CompilePending(AtNode *node, SeExprData *data)
+{
+   std::lock_guard<std::mutex> lock(data->compileMutex);
+   if (data->pending.load(std::memory_order_relaxed))
+   {
+      SetupExpr(node, data);
+      data->pending.store(false, std::memory_order_release);
+   }
+}
+
+// Compilation job, the Arnold side of the setup is left to the first evaluation
+static void PreparePending(AtNode *node, SeExprData *data)
+{
+   std::lock_guard<std::mutex> lock(data->compileMutex);
+   if (data->pending.load(std::memory_order_relaxed))
+   {
+      PrepareExpr(node, data);
+   }
+}
+
+// Plugin owned compilation threads (see 'seexpr_compile_threads')
+//   Jobs only parse, prepare and JIT compile expressions (no Arnold API
+//   call besides messages), the first evaluation then only binds the
+//   prepared expression or blocks until the job is done
+class CompilePool
+{
+public:
+
+   static void Submit(AtNode *node, SeExprData *data, int nworkers)
+   {
+      std::lock_guard<std::mutex> lock(sMutex);
+      sStop = false;
+      while (int(sWorkers.size()) < nworkers)
+      {
+         sWorkers.push_back(std::thread(Work));
+      }
+      Job job = {node, data};
+      sJobs.push_back(job);
+      ++(data->compileJobs);
+      sWork.notify_one();
+   }
+
+   // Remove node's queued job, wait for it if already running
+   static void Cancel(SeExprData *data)
+   {
+      std::unique_lock<std::mutex> lock(sMutex);
+      for (std::deque<Job>::iterator it=sJobs.begin(); it!=sJobs.end();)
+      {
+         if (it->data == data)
+         {
+            it = sJobs.erase(it);
+            --(data->compileJobs);
+         }
+         else
+         {
+            ++it;
+         }
+      }
+      sDone.wait(lock, [data] { return data->compileJobs == 0; });
+   }
+
+   // Called once no seexpr node remains (no job left)
+   static void Stop()
+   {
+      std::vector<std::thread> workers;
+      {
+         std::lock_guard<std::mutex> lock(sMutex);
+         sStop = true;
+         workers.swap(sWorkers);
+         sWork.notify_all();
+      }
+      for (size_t i=0; i<workers.size(); ++i)
+      {
+         workers[i].join();
+      }
+   }
+
+private:
+
+   struct Job
+   {
+      AtNode *node;
+      SeExprData *data;
+   };
+
+   static void Work()
+   {
+      std::unique_lock<std::mutex> lock(sMutex);
+      while (true)
+      {
+         sWork.wait(lock, [] { return sStop || !sJobs.empty(); });
+         if (sJobs.empty())
+         {
+            return;
+         }
+         Job job = sJobs.front();
+         sJobs.pop_front();
+         lock.unlock();
+         
+         PreparePending(job.node, job.data);
+         
+         lock.lock();
+         --(job.data->compileJobs);
+         sDone.notify_all();
+      }
+   }
+
+   static std::mutex sMutex;
+   static std::condition_variable sWork;
+   static std::condition_variable sDone;
+   static std::deque<Job> sJobs;
+   static std::vector<std::thread> sWorkers;
+   static bool sStop;
+};
+
+std::mutex CompilePool::sMutex;
+std::condition_variable CompilePool::sWork;
+std::condition_variable CompilePool::sDone;
+std::deque<CompilePool::Job> CompilePool::sJobs;
+std::vector<std::thread> CompilePool::sWorkers;
+bool CompilePool::sStop = false;
+
+// Render end statistics report (see 'seexpr_stats')
+//   Nodes add their merged counters when finished, the report is printed
+//   (and optionally written as JSON) once the last seexpr node is finished
+class StatsReport
+{
+public:
+
+   static void SetFile(const std::string &path)
+   {
+      std::lock_guard<std::mutex> lock(sMutex);
+      sFile = path;
+   }
+
+   static void Add(AtNode *node, const SeExprData *data)
+   {
+      Entry entry;
+      entry.name = AiNodeGetName(node);
+      entry.eval = data->evalStats;
+      entry.eval.evaluations += data->invalidEvals;
+      entry.eval.errors += data->invalidEvals;
+      entry.memoHits = data->memoHits;
+      entry.memoMisses = data->memoMisses;
+      entry.serializedEvals = data->serializedEvals;
+      entry.mutexWaitTime = data->mutexWaitTime;
+      entry.setups = data->setups;
+      entry.rebinds = data->rebinds;
+
+      std::lock_guard<std::mutex> lock(sMutex);
+      sEntries.push_back(entry);
+   }
+
+   static void Flush()
+   {
+      std::lock_guard<std::mutex> lock(sMutex);
+      
+      if (sEntries.empty())
+      {
+         return;
+      }
+
+      std::sort(sEntries.begin(), sEntries.end(), [](const Entry &a, const Entry &b)
+      {
+         return (a.eval.totalTime > b.eval.totalTime);
+      });
+
+      int width = 4;
+      for (size_t i=0; i<sEntries.size(); ++i)
+      {
+         width = std::max(width, int(sEntries[i].name.length()));
+      }
+
+      AiMsgInfo("[seexpr] Evaluation statistics (%u node(s), sorted by total time)", unsigned(sEntries.size()));
+      AiMsgInfo("[seexpr]   %-*s %12s %12s %12s %12s %10s %10s %6s %7s %10s %10s %9s %9s %9s %9s %9s", width, "node",
+                "evals", "constant", "memo", "memo miss", "serialized", "wait ms", "setups", "rebinds", "errors", "total ms", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+      for (size_t i=0; i<sEntries.size(); ++i)
       {
-         ArnoldShaderVar *var = new ArnoldShaderVar(name, (data ? varit->second >= data->numfvars : false));
-         mShaderVars.push_back(var);
-         return var;
+         const Entry &e = sEntries[i];
+         AiMsgInfo("[seexpr]   %-*s %12llu %12llu %12llu %12llu %10llu %10.3f %6u %7u %10llu %10.3f %9.3f %9.3f %9.3f %9.3f %9.3f", width, e.name.c_str(),
+                   e.eval.evaluations, e.eval.constantHits, e.memoHits, e.memoMisses, e.serializedEvals, e.mutexWaitTime, e.setups, e.rebinds, e.eval.errors,
+                   1e-6 * double(e.eval.totalTime), Mean(e.eval), 1e-3 * double(e.eval.percentile(0.5)), 1e-3 * double(e.eval.percentile(0.9)),
+                   1e-3 * double(e.eval.percentile(0.99)), 1e-3 * double(e.eval.maxTime));
       }
-      else
+
+      if (!sFile.empty())
       {
-         AiMsgWarning("[seexpr] Unknown variable \"%s\"", name.c_str());
-         return 0;
+         WriteJSON();
       }
+
+      sEntries.clear();
+      sFile = "";
    }
-   
-   virtual SeExpr2::ExprFunc* resolveFunc(const std::string&) const
+
+private:
+
+   struct Entry
    {
-      return 0;
-   }
+      std::string name;
+      EvalStats eval;
+      unsigned long long memoHits;
+      unsigned long long memoMisses;
+      unsigned long long serializedEvals;
+      double mutexWaitTime;
+      unsigned int setups;
+      unsigned int rebinds;
+   };
 
-   // Note: resolveVar, resolveFunc are called when compiling the function
-   //       or is that fhe first time the function is run???
+   // microseconds
+   static double Mean(const EvalStats &stats)
+   {
+      return (stats.evaluations > 0 ? 1e-3 * double(stats.totalTime) / double(stats.evaluations) : 0.0);
+   }
 
-   bool bindExternals(AtNode *node, AtShaderGlobals *sg)
+   static void WriteString(FILE *f, const std::string &str)
    {
-      if (!boundTo(sg))
+      fputc('"', f);
+      for (size_t i=0; i<str.length(); ++i)
       {
-         for (std::vector<ArnoldSgVar*>::iterator it=mSgVars.begin(); it!=mSgVars.end(); ++it)
+         unsigned char c = (unsigned char) str[i];
+         if (c == '"' || c == '\\')
          {
-            if (!(*it)->bind(node, sg))
-            {
-               //AiMsgError("[seexpr] Could not bind shader globals \"%s\"", (*it)->name());
-               AiMsgWarning("[seexpr] Could not bind shader globals \"%s\"", (*it)->name());
-               return false;
-            }
+            fprintf(f, "\\%c", c);
          }
-         for (std::vector<ArnoldUserVar*>::iterator it=mUserVars.begin(); it!=mUserVars.end(); ++it)
+         else if (c < 0x20)
          {
-            if (!(*it)->bind(node, sg))
-            {
-               //AiMsgError("[seexpr] Could not bind user variable \"%s\"", (*it)->name());
-               AiMsgWarning("[seexpr] Could not bind user variable \"%s\"", (*it)->name());
-               return false;
-            }
+            fprintf(f, "\\u%04x", unsigned(c));
          }
-         for (std::vector<ArnoldShaderVar*>::iterator it=mShaderVars.begin(); it!=mShaderVars.end(); ++it)
+         else
          {
-            if (!(*it)->bind(node, sg))
-            {
-               //AiMsgError("[seexpr] Could not bind shader variable \"%s\"", (*it)->name());
-               AiMsgWarning("[seexpr] Could not bind shader variable \"%s\"", (*it)->name());
-               return false;
-            }
+            fputc(c, f);
          }
       }
-      mBoundSg = sg;
-      mBound = true;
-      return true;
+      fputc('"', f);
    }
 
-   bool bindShaderParams(AtArray *fvalues, AtArray *vvalues)
+   static void WriteJSON()
    {
-      if (mBound)
-      {
-         for (std::vector<ArnoldShaderVar*>::iterator it=mShaderVars.begin(); it!=mShaderVars.end(); ++it)
-         {
-            (*it)->bindShaderParams(fvalues, vvalues);
-         }
-
-         return true;
-      }
-      else
+      FILE *f = fopen(sFile.c_str(), "w");
+      if (!f)
       {
-         return false;
+         AiMsgWarning("[seexpr] Could not write statistics to \"%s\"", sFile.c_str());
+         return;
       }
-   }
-
-   void clearExternals()
-   {
-      for (std::vector<ArnoldSgVar*>::iterator it=mSgVars.begin(); it!=mSgVars.end(); ++it)
+      
+      fprintf(f, "{\n  \"nodes\": [");
+      for (size_t i=0; i<sEntries.size(); ++i)
       {
-         delete *it;
+         const Entry &e = sEntries[i];
+         fprintf(f, "%s\n    {\"name\": ", (i > 0 ? "," : ""));
+         WriteString(f, e.name);
+         fprintf(f, ", \"evaluations\": %llu, \"constant_hits\": %llu, \"memo_hits\": %llu, \"memo_misses\": %llu", e.eval.evaluations, e.eval.constantHits, e.memoHits, e.memoMisses);
+         fprintf(f, ", \"serialized_evals\": %llu, \"mutex_wait_ms\": %.6f, \"setups\": %u, \"rebinds\": %u, \"errors\": %llu", e.serializedEvals, e.mutexWaitTime, e.setups, e.rebinds, e.eval.errors);
+         fprintf(f, ", \"total_ms\": %.6f, \"mean_us\": %.6f, \"p50_us\": %.6f, \"p90_us\": %.6f, \"p99_us\": %.6f, \"max_us\": %.6f}",
+                 1e-6 * double(e.eval.totalTime), Mean(e.eval), 1e-3 * double(e.eval.percentile(0.5)), 1e-3 * double(e.eval.percentile(0.9)),
+                 1e-3 * double(e.eval.percentile(0.99)), 1e-3 * double(e.eval.maxTime));
       }
-      for (std::vector<ArnoldUserVar*>::iterator it=mUserVars.begin(); it!=mUserVars.end(); ++it)
+      fprintf(f, "\n  ]\n}\n");
+      
+      if (fclose(f) != 0)
       {
-         delete *it;
+         AiMsgWarning("[seexpr] Could not write statistics to \"%s\"", sFile.c_str());
       }
-      for (std::vector<ArnoldShaderVar*>::iterator it=mShaderVars.begin(); it!=mShaderVars.end(); ++it)
+      else
       {
-         delete *it;
+         AiMsgInfo("[seexpr] Statistics written to \"%s\"", sFile.c_str());
       }
-      mSgVars.clear();
-      mUserVars.clear();
-      mShaderVars.clear();
-      mBound = false;
    }
 
-   inline size_t numSgVars() const { return mSgVars.size(); }
-   inline size_t numUserVars() const { return mUserVars.size(); }
-   inline size_t numShaderVars() const { return mShaderVars.size(); }
-   inline bool boundTo(AtShaderGlobals *sg) const { return (mBound && mBoundSg == sg); }
-
-private:
-
-   bool mBound;
-   mutable std::vector<ArnoldSgVar*> mSgVars;
-   mutable std::vector<ArnoldUserVar*> mUserVars;
-   mutable std::vector<ArnoldShaderVar*> mShaderVars;
-   AtShaderGlobals *mBoundSg;
-   AtNode *mNode;
+   static std::mutex sMutex;
+   static std::string sFile;
+   static std::vector<Entry> sEntries;
 };
 
-// ---
+std::mutex StatsReport::sMutex;
+std::string StatsReport::sFile;
+std::vector<StatsReport::Entry> StatsReport::sEntries;
 
 node_parameters
 {
@@ -1428,78 +4193,79 @@ node_parameters
    AiParameterArray(SSTR::vparam_value, AiArray(0, 0, AI_TYPE_VECTOR));
    AiParameterBool(SSTR::stop_on_error, false);
    AiParameterVec("error_value", 1.0f, 0.0f, 0.0f);
+   AiParameterEnum(SSTR::backend, b_interpreter, SeExprBackendNames);
+   AiParameterArray(SSTR::output_names, AiArray(0, 0, AI_TYPE_STRING));
+   AiParameterInt(SSTR::curve_resolution, 0);
 }
 
 node_initialize
 {
    SeExprData *data = new SeExprData();
 
-   data->varBlockCreator = new SeExpr2::VarBlockCreator();
-   data->outputIndex = data->varBlockCreator->registerVariable("__output", SeExpr2::ExprType().FP(3).Varying());
-
-   data->nthreads = 0;
-   data->exprs = 0;
-   data->outputData = 0;
+   data->outputIndex = -1;
+   data->expr = 0;
+   data->mutex = 0;
+   data->memoize = false;
+   data->curveResolution = 0;
+   data->backend = b_interpreter;
+   data->pending = false;
+   data->compileJobs = 0;
+   data->stats = false;
+   data->memoHits = 0;
+   data->memoMisses = 0;
+   data->serializedEvals = 0;
+   data->mutexWaitTime = 0.0;
+   data->setups = 0;
+   data->rebinds = 0;
+   data->invalidEvals = 0;
 
    AiNodeSetLocalData(node, (void*)data);
+
+   ExprCache::NodeInitialized();
 }
 
 node_update
 {
    SeExprData *data = (SeExprData*) AiNodeGetLocalData(node);
 
-   int nthreads = AiNodeGetInt(AiUniverseGetOptions(), "threads");
+   CompilePool::Cancel(data);
 
-   if (data->nthreads > 0)
-   {
-      for (int i=0; i<data->nthreads; ++i)
-      {
-         if (data->exprs[i])
-         {
-            delete data->exprs[i];
-         }
-         if (data->varBlocks[i])
-         {
-            delete data->varBlocks[i];
-         }
-      }
+   // Kept as is if the new cache key matches (only parameter values changed)
+   bool reusable = (data->expr && data->valid && !data->pending);
+   std::string previousKey = data->key;
+
+   data->stopOnError = AiNodeGetBool(node, SSTR::stop_on_error);
 
-      delete[] data->exprs;
-      delete[] data->varBlocks;
-      delete[] data->outputData;
+   // Counters collected so far follow the previous setting
+   CollectThreadStats(data);
 
-      data->exprs = 0;
-      data->varBlocks = 0;
-      data->outputData = 0;
+   std::string statsFile;
+   data->stats = GetOptionsStats(statsFile);
+   if (data->stats)
+   {
+      StatsReport::SetFile(statsFile);
    }
 
-   data->stopOnError = AiNodeGetBool(node, SSTR::stop_on_error);
-   data->valid = false;
-   data->constant = false;
-   data->threadsafe = false;
-   data->mutex = 0;
-   data->sgdependent = false;
    data->numfvars = 0;
    data->numvvars = 0;
-   data->value = AI_V3_ZERO;
-   data->varindex.clear();
-   data->nthreads = nthreads;
-   data->exprs = new ArnoldExpr*[nthreads];
-   data->varBlocks = new SeExpr2::VarBlock*[nthreads];
-   data->outputData = new double[3 * nthreads];
-   data->source = AiNodeGetStr(node, SSTR::expression);
-
-   ArnoldExpr *expr = new ArnoldExpr(node, data->source);
-   // always vector for now
-   expr->setDesiredReturnType(SeExpr2::ExprType().FP(3).Varying());
-   expr->setVarBlockCreator(data->varBlockCreator); // is this required?
-
-   for (unsigned int tid=0, offset=0; tid<nthreads; ++tid, offset+=3)
+   data->outputType = AiNodeEntryGetOutputType(AiNodeGetNodeEntry(node));
+   data->outputDim = (data->outputType == AI_TYPE_FLOAT ? 1 : (data->outputType == AI_TYPE_RGBA ? 4 : 3));
+   data->outputNames.clear();
+   
+   AtArray *onames = AiNodeGetArray(node, SSTR::output_names);
+   for (unsigned int i=0; i<onames->nelements; ++i)
    {
-      data->exprs[tid] = 0;
-      data->varBlocks[tid] = new SeExpr2::VarBlock(data->varBlockCreator->create());
-      data->varBlocks[tid]->Pointer(data->outputIndex) = data->outputData + offset;
+      data->outputNames.push_back(AiArrayGetStr(onames, i));
    }
+   
+   data->returnDim = data->outputDim + 3 * int(data->outputNames.size());
+   data->varindex.clear();
+   data->linked.clear();
+   data->links.clear();
+   data->fvalues = AiNodeGetArray(node, SSTR::fparam_value);
+   data->vvalues = AiNodeGetArray(node, SSTR::vparam_value);
+   data->source = AiNodeGetStr(node, SSTR::expression);
+   data->curveResolution = std::max(0, AiNodeGetInt(node, SSTR::curve_resolution));
 
    std::map<std::string, unsigned int>::iterator varit;
    
@@ -1514,9 +4280,9 @@ node_update
       if (varit != data->varindex.end())
       {
          AiMsgWarning("[seexpr] Variable name already in use \"%s\"", var.c_str());
+         ResetExpr(data);
          data->numfvars = 0;
          data->varindex.clear();
-         delete expr;
          return;
       }
       else
@@ -1536,10 +4302,10 @@ node_update
       if (varit != data->varindex.end())
       {
          AiMsgWarning("[seexpr] Variable name already in use \"%s\"", var.c_str());
+         ResetExpr(data);
          data->numfvars = 0;
          data->numvvars = 0;
          data->varindex.clear();
-         delete expr;
          return;
       }
       else
@@ -1548,184 +4314,166 @@ node_update
       }
    }
 
-   if (expr->isValid())
+   // Unlinked parameters are uniform for the whole update
+   char tmp[128];
+   data->links.resize(data->numfvars + data->numvvars);
+   data->linked.resize(data->numfvars + data->numvvars, false);
+   for (unsigned int i=0; i<data->numfvars; ++i)
    {
-      data->valid = true;
-      data->threadsafe = expr->isThreadSafe();
-      if (!data->threadsafe)
+      sprintf(tmp, "fparam_value[%d]", i);
+      GetParamLink(node, tmp, data->links[i], 0);
+      data->linked[i] = data->links[i].linked;
+   }
+   for (unsigned int i=0; i<data->numvvars; ++i)
+   {
+      ParamLink &link = data->links[data->numfvars + i];
+      sprintf(tmp, "vparam_value[%d]", i);
+      if (!GetParamLink(node, tmp, link, 0))
       {
-         AiMsgWarning("[seexpr] Expression for node \"%s\" is not thread safe", AiNodeGetName(node));
-         AiCritSecInit(&(data->mutex));
+         sprintf(tmp, "vparam_value[%d].x", i);
+         GetParamLink(node, tmp, link, 0);
+         sprintf(tmp, "vparam_value[%d].y", i);
+         GetParamLink(node, tmp, link, 1);
+         sprintf(tmp, "vparam_value[%d].z", i);
+         GetParamLink(node, tmp, link, 2);
       }
+      data->linked[data->numfvars + i] = link.linked;
+   }
 
-      if (expr->isConstant())
-      {
-         // No vars or func reference (implies threadsafe)
-         data->constant = true;
-         data->sgdependent = false;
+   // Evaluation backend, can be overridden globally by 'seexpr_backend' on options node
+   int backend = AiNodeGetInt(node, SSTR::backend);
+   GetOptionsBackend(backend);
+   CheckBackend(backend);
 
-         // Do not need to bind externals
-         expr->evalMultiple(data->varBlocks[0], data->outputIndex, 0, 1);
-         
-         data->value.x = data->outputData[0];
-         data->value.y = data->outputData[1];
-         data->value.z = data->outputData[2];
-         
-         delete expr;
+   // Nodes with the same expression, variables and links share the compiled expression
+   data->key = ExprCache::Key(data->source, backend, data->returnDim, data->curveResolution, fnames, vnames, data->linked, data->outputNames);
+   data->backend = backend;
+
+   if (data->fvalues->nelements != fnames->nelements)
+   {
+      if (data->fvalues->nelements < fnames->nelements)
+      {
+         AiMsgWarning("[seexpr] More float param variable names than values. Missing values will be set to 0.");
       }
       else
       {
-         // Check if expression's input are all constant
-         
-         char tmp[128];
-         bool allParamsConstant = true;
-         
-         AtArray *fvalues = AiNodeGetArray(node, SSTR::fparam_value);
-         if (fvalues->nelements != fnames->nelements)
-         {
-            if (fvalues->nelements < fnames->nelements)
-            {
-               AiMsgWarning("[seexpr] More float param variable names than values. Missing values will be set to 0.");
-            }
-            else
-            {
-               AiMsgWarning("[seexpr] More float param variable values than names. Extra values will be ignored.");
-            }
-         }
-         
-         for (unsigned int i=0; i<fnames->nelements; ++i)
-         {
-            std::string var = AiArrayGetStr(fnames, i);
-
-            if (expr->usesVar(var))
-            {
-               sprintf(tmp, "fparam_value[%d]", i);
-               if (AiNodeIsLinked(node, tmp))
-               {
-                  allParamsConstant = false;
-               }
-            }
-         }
-         
-         AtArray *vvalues = AiNodeGetArray(node, SSTR::vparam_value);
-         if (vvalues->nelements != vnames->nelements)
-         {
-            if (vvalues->nelements < vnames->nelements)
-            {
-               AiMsgWarning("[seexpr] More vector param variable names than values. Missing values will be set to (0, 0, 0).");
-            }
-            else
-            {
-               AiMsgWarning("[seexpr] More vector param variable values than names. Extra values will be ignored.");
-            }
-         }
-         
-         for (unsigned int i=0; i<vnames->nelements; ++i)
-         {
-            std::string var = AiArrayGetStr(vnames, i);
-
-            if (expr->usesVar(var))
-            {
-               sprintf(tmp, "vparam_value[%d]", i);
-               if (AiNodeIsLinked(node, tmp))
-               {
-                  allParamsConstant = false;
-               }
-               else
-               {
-                  sprintf(tmp, "vparam_value[%d].x", i);
-                  if (AiNodeIsLinked(node, tmp))
-                  {
-                     allParamsConstant = false;
-                  }
-                  else
-                  {
-                     sprintf(tmp, "vparam_value[%d].y", i);
-                     if (AiNodeIsLinked(node, tmp))
-                     {
-                        allParamsConstant = false;
-                     }
-                     else
-                     {
-                        sprintf(tmp, "vparam_value[%d].z", i);
-                        if (AiNodeIsLinked(node, tmp))
-                        {
-                           allParamsConstant = false;
-                        }
-                     }
-                  }
-               }
-            }
-         }
-
-         data->sgdependent = (!allParamsConstant || expr->numSgVars() > 0 || expr->numUserVars() > 0);
-
-         if (!data->sgdependent || !data->threadsafe)
-         {
-            // Keep current expression as the one to evaluate
-            AiMsgDebug("[seexpr] Use same expression object for all thread(s)");
-            data->exprs[0] = expr;
-         }
-         else
-         {
-            // Create one expression per thread (once we have sg)
-            AiMsgDebug("[seexpr] Create expression object per thread");
-            delete expr;
-         }
+         AiMsgWarning("[seexpr] More float param variable values than names. Extra values will be ignored.");
       }
    }
-   else
+   
+   if (data->vvalues->nelements != vnames->nelements)
    {
-      AiMsgWarning("[seexpr] Invalid expression (%s)", expr->parseError().c_str());
-      delete expr;
+      if (data->vvalues->nelements < vnames->nelements)
+      {
+         AiMsgWarning("[seexpr] More vector param variable names than values. Missing values will be set to (0, 0, 0).");
+      }
+      else
+      {
+         AiMsgWarning("[seexpr] More vector param variable values than names. Extra values will be ignored.");
+      }
    }
    
-   if (!data->valid)
+   if (reusable && data->key == previousKey)
    {
-      data->numfvars = 0;
-      data->numvvars = 0;
+      RebindExpr(node, data);
+      return;
+   }
+
+   ResetExpr(data);
+
+   if (GetOptionsLazyCompile())
+   {
+      // Compiled on first evaluation, never for nodes that aren't shaded
+      data->pending = true;
+      return;
+   }
+
+   int compileThreads = GetOptionsCompileThreads();
+   if (compileThreads > 0)
+   {
+      // Compiled in the background, first evaluation waits if not done yet and
+      //   binds the expression to Arnold
+      data->pending = true;
+      CompilePool::Submit(node, data, compileThreads);
+      return;
    }
+
+   SetupExpr(node, data);
 }
 
 node_finish
 {
    SeExprData *data = (SeExprData*) AiNodeGetLocalData(node);
    
-   if (data->nthreads > 0)
+   CompilePool::Cancel(data);
+
+   if (data->pending)
    {
-      for (int i=0; i<data->nthreads; ++i)
-      {
-         if (data->exprs[i])
-         {
-            delete data->exprs[i];
-         }
-         if (data->varBlocks[i])
-         {
-            delete data->varBlocks[i];
-         }
-      }
+      AiMsgDebug("[seexpr] Node \"%s\" was never evaluated, compilation skipped", AiNodeGetName(node));
+   }
 
-      delete[] data->exprs;
-      delete[] data->varBlocks;
-      delete[] data->outputData;
+   DestroyThreadData(data);
+   DestroyTextures(data);
+
+   if (data->stats)
+   {
+      StatsReport::Add(node, data);
    }
 
-   delete data->varBlockCreator;
+   if (data->expr)
+   {
+      ExprCache::Release(data->expr);
+   }
 
-   if (!data->threadsafe && data->mutex)
+   if (data->mutex)
    {
       AiCritSecClose(&(data->mutex));
    }
 
    delete data;
+
+   if (ExprCache::NodeFinished())
+   {
+      CompilePool::Stop();
+      StatsReport::Flush();
+   }
 }
 
-static AtVector Failed(AtShaderGlobals *sg, AtNode *node, SeExprData *data, bool stopOnError, const char *errMsg=0)
+static void SetOutput(AtShaderGlobals *sg, int outputType, const double *value)
 {
-   if (!data->threadsafe)
+   switch (outputType)
    {
-      AiCritSecLeave(&(data->mutex));
+   case AI_TYPE_FLOAT:
+      sg->out.FLT = float(value[0]);
+      break;
+   case AI_TYPE_RGB:
+      sg->out.RGB.r = float(value[0]);
+      sg->out.RGB.g = float(value[1]);
+      sg->out.RGB.b = float(value[2]);
+      break;
+   case AI_TYPE_RGBA:
+      sg->out.RGBA.r = float(value[0]);
+      sg->out.RGBA.g = float(value[1]);
+      sg->out.RGBA.b = float(value[2]);
+      sg->out.RGBA.a = float(value[3]);
+      break;
+   default:
+      sg->out.VEC.x = float(value[0]);
+      sg->out.VEC.y = float(value[1]);
+      sg->out.VEC.z = float(value[2]);
+      break;
    }
+}
+
+static void SetErrorOutput(AtShaderGlobals *sg, AtNode *node, int outputType)
+{
+   AtVector err = AiShaderEvalParamVec(p_error_value);
+   double value[4] = {err.x, err.y, err.z, 1.0};
+   SetOutput(sg, outputType, value);
+}
+
+static void Failed(AtShaderGlobals *sg, AtNode *node, SeExprData *data, bool stopOnError, const char *errMsg=0)
+{
    if (stopOnError)
    {
       if (errMsg)
@@ -1737,102 +4485,158 @@ static AtVector Failed(AtShaderGlobals *sg, AtNode *node, SeExprData *data, bool
          AiMsgError("[seexpr] Failed");
       }
    }
-   return AiShaderEvalParamVec(p_error_value);
+   SetErrorOutput(sg, node, data->outputType);
 }
 
-shader_evaluate
+// Returns false if the error value was output
+// Named outputs are read back by selectors (see SeExprGetOutput)
+static inline void StampOutput(SeExprThreadData *td, const AtShaderGlobals *sg, const SeExprData *data)
 {
-   SeExprData *data = (SeExprData*) AiNodeGetLocalData(node);
+   if (!data->outputNames.empty())
+   {
+      td->outputStamp.set(sg);
+      td->outputStamped = true;
+   }
+}
 
+static bool EvaluateExpr(AtNode *node, AtShaderGlobals *sg, SeExprData *data)
+{
    if (!data->valid)
    {
       if (data->stopOnError)
       {
          AiMsgError("[seexpr] Invalid expression");
       }
-      sg->out.VEC = AiShaderEvalParamVec(p_error_value);
+      SetErrorOutput(sg, node, data->outputType);
+      return false;
    }
    else
    {
       if (data->constant)
       {
-         sg->out.VEC = data->value;
+         SetOutput(sg, data->outputType, data->value.data());
       }
       else
       {
-         AtVector rv = AI_V3_ZERO;
-         
-         if (!data->threadsafe)
-         {
-            AiCritSecEnter(&(data->mutex));
-         }
-         
-         ArnoldExpr *expr = 0;
+         SeExprThreadData *td = GetThreadData(data, sg->tid);
+         ArnoldExpr *expr = data->expr;
          
-         if (!data->threadsafe || !data->sgdependent)
-         {
-            expr = data->exprs[0];
-         }
-         else
+         if (!data->threadsafe && !data->mutex)
          {
-            expr = data->exprs[sg->tid];
+            // Private expression object, only parsed by threads that actually shade the node
+            expr = td->expr;
             if (!expr)
             {
-               expr = new ArnoldExpr(node, data->source);
-               data->exprs[sg->tid] = expr;   
+               expr = data->expr->createInstance();
+               expr->initBindings(td->bindings, node, td->varBlock);
+               td->expr = expr;
             }
          }
 
          if (expr && expr->isValid())
          {
-            AtArray *fvalues = AiShaderEvalParamArray(p_fparam_value);
-            // if (fvalues->nelements != data->numfvars)
-            // {
-            //    AiMsgWarning("[seexpr] fparam_name and fparam_value size mismatch (%d for %d)", data->numfvars, fvalues->nelements);
-            //    sg->out.VEC = Failed(sg, node, data, data->stopOnError, "Invalid float parameters setup");
-            //    return;
-            // }
-
-            AtArray *vvalues = AiShaderEvalParamArray(p_vparam_value);
-            // if (vvalues->nelements != data->numvvars)
-            // {
-            //    AiMsgWarning("[seexpr] vparam_name and vparam_value size mismatch (%d for %d)", data->numvvars, vvalues->nelements);
-            //    sg->out.VEC = Failed(sg, node, data, data->stopOnError, "Invalid vector parameters setup");
-            //    return;
-            // }
-
-            if (!expr->bindExternals(node, sg))
+            ArnoldBindings &bindings = td->bindings;
+            
+            if (!bindings.node)
             {
-               sg->out.VEC = Failed(sg, node, data, data->stopOnError, "Could not bind external parameters");
-               return;
+               expr->initBindings(bindings, node, td->varBlock);
             }
 
-            if (!expr->bindShaderParams(fvalues, vvalues))
+            bindings.constants = &(data->constants);
+            bindings.shapeTypes = &(data->shapeTypes);
+            expr->bindExternals(bindings, sg);
+
+            // Same shading point as last evaluation (node linked to several inputs)
+            ShadingPointKey key;
+            if (data->memoize)
             {
-               sg->out.VEC = Failed(sg, node, data, data->stopOnError, "Could not bind external parameters");
-               return;
+               key.set(sg, expr->numUserVars() > 0);
+               if (td->memoValid && key == td->memoKey && bindings.sgValues == td->memoSgValues)
+               {
+                  td->memoHits += 1;
+                  StampOutput(td, sg, data);
+                  SetOutput(sg, data->outputType, td->output);
+                  return true;
+               }
+               td->memoValid = false;
+               td->memoMisses += 1;
             }
 
-            expr->evalMultiple(data->varBlocks[sg->tid], data->outputIndex, 0, 1);
+            // Linked elements are evaluated lazily by the variable references
+            expr->bindShaderParams(bindings, data->fvalues, data->vvalues, data->links.data());
+            bindings.textures = data->textures.data();
+
+            // Variable references read their values from the current thread bindings
+            ArnoldBindings *prevBindings = gBindings;
+            gBindings = &bindings;
+            
+            if (data->mutex)
+            {
+               std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+               AiCritSecEnter(&(data->mutex));
+               td->mutexWaitTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+               td->serializedEvals += 1;
+               
+               expr->evalMultiple(td->varBlock, data->outputIndex, 0, 1);
+               
+               AiCritSecLeave(&(data->mutex));
+            }
+            else
+            {
+               expr->evalMultiple(td->varBlock, data->outputIndex, 0, 1);
+            }
             
-            unsigned int outputDataOffset = 3 * sg->tid;
+            gBindings = prevBindings;
 
-            rv.x = data->outputData[outputDataOffset + 0];
-            rv.y = data->outputData[outputDataOffset + 1];
-            rv.z = data->outputData[outputDataOffset + 2];
+            if (data->memoize)
+            {
+               td->memoKey = key;
+               td->memoSgValues = bindings.sgValues;
+               td->memoValid = true;
+            }
+
+            StampOutput(td, sg, data);
+            SetOutput(sg, data->outputType, td->output);
          }
          else
          {
-            sg->out.VEC = Failed(sg, node, data, data->stopOnError, "Expression is NULL or invalid");
-            return;
-         }
-         
-         if (!data->threadsafe)
-         {
-            AiCritSecLeave(&(data->mutex));
+            td->outputStamped = false;
+            Failed(sg, node, data, data->stopOnError, "Expression is NULL or invalid");
+            return false;
          }
-         
-         sg->out.VEC = rv;
       }
    }
+   
+   return true;
+}
+
+shader_evaluate
+{
+   SeExprData *data = (SeExprData*) AiNodeGetLocalData(node);
+
+   if (data->pending.load(std::memory_order_acquire))
+   {
+      CompilePending(node, data);
+   }
+
+   if (!data->stats)
+   {
+      EvaluateExpr(node, sg, data);
+   }
+   else if (!data->valid)
+   {
+      // No thread context for invalid expressions
+      EvaluateExpr(node, sg, data);
+      ++(data->invalidEvals);
+   }
+   else
+   {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      
+      bool success = EvaluateExpr(node, sg, data);
+      
+      unsigned long long ns = (unsigned long long) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+      EvalStats *stats = (data->constant ? GetConstantStats(data, sg->tid) : &(GetThreadData(data, sg->tid)->stats));
+      stats->add(ns, data->constant, !success);
+   }
 }
@@ -0,0 +1,123 @@
+// Copyright 2014 Gaetan Guidet
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ai.h>
+#include <cstring>
+
+// Named output selector
+//   'input' must be linked to a seexpr node listing 'output' in its
+//   'output_names' parameter. The named output is read from the source's
+//   evaluation for the current shading query, the input is only evaluated
+//   when no other link did it first
+
+AI_SHADER_NODE_EXPORT_METHODS(SeExprOutputMtd);
+
+enum SeExprOutputParams
+{
+   p_input = 0,
+   p_output
+};
+
+namespace SSTR
+{
+   extern AtString input;
+   extern AtString output;
+}
+
+// Defined in seexpr.cpp
+int SeExprFindOutput(AtNode *node, const char *name);
+bool SeExprGetOutput(AtNode *node, AtShaderGlobals *sg, int index, AtVector &out);
+
+struct SeExprOutputData
+{
+   AtNode *source;
+   int index;
+};
+
+node_parameters
+{
+   AiParameterVec("input", 0.0f, 0.0f, 0.0f);
+   AiParameterStr(SSTR::output, "");
+}
+
+node_initialize
+{
+   SeExprOutputData *data = new SeExprOutputData();
+   
+   data->source = 0;
+   data->index = -1;
+   
+   AiNodeSetLocalData(node, (void*)data);
+}
+
+node_update
+{
+   SeExprOutputData *data = (SeExprOutputData*) AiNodeGetLocalData(node);
+   
+   data->source = 0;
+   data->index = -1;
+   
+   const char *name = AiNodeGetStr(node, SSTR::output);
+   
+   if (name[0] == '\0')
+   {
+      // pass through main output
+      return;
+   }
+   
+   AtNode *source = AiNodeGetLink(node, SSTR::input);
+   const char *type = (source ? AiNodeEntryGetName(AiNodeGetNodeEntry(source)) : "");
+   
+   if (strncmp(type, "seexpr", 6) != 0 || !strcmp(type, "seexpr_output"))
+   {
+      AiMsgWarning("[seexpr] \"input\" parameter of node \"%s\" should be linked to a seexpr node", AiNodeGetName(node));
+      return;
+   }
+   
+   data->index = SeExprFindOutput(source, name);
+   
+   if (data->index < 0)
+   {
+      AiMsgWarning("[seexpr] Node \"%s\" has no output named \"%s\"", AiNodeGetName(source), name);
+      return;
+   }
+   
+   data->source = source;
+}
+
+node_finish
+{
+   SeExprOutputData *data = (SeExprOutputData*) AiNodeGetLocalData(node);
+   
+   delete data;
+}
+
+shader_evaluate
+{
+   SeExprOutputData *data = (SeExprOutputData*) AiNodeGetLocalData(node);
+   
+   AtVector out;
+   
+   if (!data->source || !SeExprGetOutput(data->source, sg, data->index, out))
+   {
+      out = AiShaderEvalParamVec(p_input);
+      
+      if (data->source)
+      {
+         SeExprGetOutput(data->source, sg, data->index, out);
+      }
+   }
+   
+   sg->out.VEC = out;
+}
@@ -0,0 +1,203 @@
+// Copyright 2014 Gaetan Guidet
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks the plugin noise functions against SeExpr's fbm, turbulence and
+//   voronoi built-ins (scalar kernels) and each instruction set kernels
+//   supported by the CPU against the scalar ones, within 1e-5 (see noise.h)
+//
+//   Returns the number of failed checks
+
+#include "../src/noise.h"
+#include <SeExpr2/Expression.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+
+static const double Tolerance = 1e-5;
+static const int NumSamples = 2000;
+
+struct Sample
+{
+   double P[3];
+   int octaves;
+   double lacunarity;
+   double gain;
+   int type;
+   double jitter;
+   double fbmScale;
+};
+
+struct Result
+{
+   double fbm;
+   double turbulence;
+   double voronoi[3];
+};
+
+static double Random(double low, double high)
+{
+   return low + (high - low) * (double(rand()) / double(RAND_MAX));
+}
+
+static std::vector<Sample> Samples()
+{
+   std::vector<Sample> samples(NumSamples);
+   srand(1234);
+   for (int i=0; i<NumSamples; ++i)
+   {
+      Sample &s = samples[i];
+      // small and large coordinates, negative ones included
+      double range = (i % 2 ? 1000.0 : 10.0);
+      for (int k=0; k<3; ++k)
+      {
+         s.P[k] = Random(-range, range);
+      }
+      s.octaves = rand() % 10;
+      s.lacunarity = Random(1.5, 3.0);
+      s.gain = Random(0.25, 0.75);
+      s.type = 1 + rand() % 5;
+      s.jitter = Random(1e-3, 1.0);
+      s.fbmScale = (i % 3 ? 0.0 : Random(0.0, 1.0));
+   }
+   return samples;
+}
+
+static Result Evaluate(const Sample &s)
+{
+   Result r;
+   r.fbm = NoiseFbm(s.P, s.octaves, s.lacunarity, s.gain);
+   r.turbulence = NoiseTurbulence(s.P, s.octaves, s.lacunarity, s.gain);
+   NoiseVoronoi(s.P, s.type, s.jitter, s.fbmScale, 4, 2.0, 0.5, r.voronoi);
+   return r;
+}
+
+static void EvalBuiltin(const char *str, double *out)
+{
+   SeExpr2::Expression expr(str);
+   if (!expr.isValid())
+   {
+      fprintf(stderr, "Invalid expression \"%s\" (%s)\n", str, expr.parseError().c_str());
+      out[0] = out[1] = out[2] = NAN;
+      return;
+   }
+   const double *value = expr.evalFP();
+   for (int k=0; k<3; ++k)
+   {
+      out[k] = value[k];
+   }
+}
+
+static Result EvaluateBuiltins(const Sample &s)
+{
+   Result r;
+   double value[3];
+   char str[512];
+
+   snprintf(str, sizeof(str), "fbm([%.17g, %.17g, %.17g], %d, %.17g, %.17g)",
+            s.P[0], s.P[1], s.P[2], s.octaves, s.lacunarity, s.gain);
+   EvalBuiltin(str, value);
+   r.fbm = value[0];
+
+   snprintf(str, sizeof(str), "turbulence([%.17g, %.17g, %.17g], %d, %.17g, %.17g)",
+            s.P[0], s.P[1], s.P[2], s.octaves, s.lacunarity, s.gain);
+   EvalBuiltin(str, value);
+   r.turbulence = value[0];
+
+   snprintf(str, sizeof(str), "voronoi([%.17g, %.17g, %.17g], %d, %.17g, %.17g, 4, 2, 0.5)",
+            s.P[0], s.P[1], s.P[2], s.type, s.jitter, s.fbmScale);
+   EvalBuiltin(str, r.voronoi);
+
+   return r;
+}
+
+static int Compare(const char *what, const char *name, const std::vector<Sample> &samples, const std::vector<Result> &expected, const std::vector<Result> &results)
+{
+   int failed = 0;
+   double maxError = 0.0;
+
+   for (size_t i=0; i<samples.size(); ++i)
+   {
+      const Result &a = expected[i];
+      const Result &b = results[i];
+      double errors[5] = {std::fabs(a.fbm - b.fbm),
+                          std::fabs(a.turbulence - b.turbulence),
+                          std::fabs(a.voronoi[0] - b.voronoi[0]),
+                          std::fabs(a.voronoi[1] - b.voronoi[1]),
+                          std::fabs(a.voronoi[2] - b.voronoi[2])};
+      for (int k=0; k<5; ++k)
+      {
+         // NaN errors fail too
+         if (!(errors[k] <= Tolerance))
+         {
+            if (failed < 10)
+            {
+               const double *P = samples[i].P;
+               fprintf(stderr, "%s %s: sample %d (%g, %g, %g) value %d differs by %g\n", name, what, int(i), P[0], P[1], P[2], k, errors[k]);
+            }
+            ++failed;
+         }
+         else if (errors[k] > maxError)
+         {
+            maxError = errors[k];
+         }
+      }
+   }
+
+   printf("%-8s %-20s max error %g, %d failure(s)\n", name, what, maxError, failed);
+
+   return failed;
+}
+
+int main(int, char**)
+{
+   static const char *Kernels[] = {"scalar", "sse4", "avx2", "avx512", NULL};
+
+   std::vector<Sample> samples = Samples();
+   std::vector<Result> builtins(samples.size());
+   std::vector<Result> reference(samples.size());
+   std::vector<Result> results(samples.size());
+   int failed = 0;
+
+   if (!NoiseUseKernels("scalar"))
+   {
+      fprintf(stderr, "No scalar noise kernels\n");
+      return 1;
+   }
+
+   for (size_t i=0; i<samples.size(); ++i)
+   {
+      builtins[i] = EvaluateBuiltins(samples[i]);
+      reference[i] = Evaluate(samples[i]);
+   }
+
+   failed += Compare("vs SeExpr built-ins", "scalar", samples, builtins, reference);
+
+   for (int k=1; Kernels[k] != NULL; ++k)
+   {
+      if (!NoiseUseKernels(Kernels[k]))
+      {
+         printf("%-8s not supported by the CPU, skipped\n", Kernels[k]);
+         continue;
+      }
+      for (size_t i=0; i<samples.size(); ++i)
+      {
+         results[i] = Evaluate(samples[i]);
+      }
+      failed += Compare("vs scalar", Kernels[k], samples, reference, results);
+   }
+
+   return failed;
+}